@@ -0,0 +1,332 @@
+/*
+ * bench:  microbenchmarks for the hot paths of the LWP library.
+ *
+ *   yield_pingpong      lwp_yield() between two LWPs
+ *   lifecycle           lwp_create() + lwp_exit() + lwp_wait() of a no-op LWP
+ *   yield_N             lwp_yield() with N runnable LWPs
+ *   swap_rfiles         swap_rfiles() on its own, no scheduler involved
+ *
+ * Each sample times a batch of operations, the report is ns/op over the
+ * samples. A summary goes to stdout and the full results to a JSON file.
+ *
+ * usage: lwpbench [-o file.json] [-s samples] [-n N[,N...]]
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+#include "lwp.h"
+
+#define BATCH           100             // operations per sample
+#define DEFAULT_SAMPLES 2000
+#define MAX_RESULTS     16
+#define BENCH_STACK     (16 * 1024)     // yield_N threads are tiny, keep N stacks cheap
+
+typedef struct result {
+    char name[32];
+    long threads;                       // runnable LWPs during the run
+    int count;                          // samples
+    double *ns;                         // ns/op per sample, sorted once done
+} result;
+
+static result results[MAX_RESULTS];
+static int nresults = 0;
+static int samples = DEFAULT_SAMPLES;
+
+// state shared with the benchmark threads
+static result *current_result;
+static volatile int stop;
+static long yield_count;
+static double batch_start;
+
+static double now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+static result *new_result(const char *name, long threads)
+{
+    result *r = &results[nresults++];
+    snprintf(r->name, sizeof(r->name), "%s", name);
+    r->threads = threads;
+    r->count = 0;
+    r->ns = malloc(samples * sizeof(double));
+    if (r->ns == NULL)
+    {
+        perror("malloc");
+        exit(EXIT_FAILURE);
+    }
+    return r;
+}
+
+static void record(result *r, double ns_per_op)
+{
+    if (r->count < samples)
+    {
+        r->ns[r->count++] = ns_per_op;
+    }
+}
+
+static int cmp_double(const void *a, const void *b)
+{
+    double x = *(const double *)a, y = *(const double *)b;
+    return (x > y) - (x < y);
+}
+
+static double percentile(result *r, double p)
+{
+    // nearest rank on the sorted samples
+    int i = (int)(p / 100.0 * r->count);
+    if (i >= r->count)
+    {
+        i = r->count - 1;
+    }
+    return r->ns[i];
+}
+
+static double mean(result *r)
+{
+    double sum = 0;
+    int i;
+    for (i = 0; i < r->count; i++)
+    {
+        sum += r->ns[i];
+    }
+    return sum / r->count;
+}
+
+/*********************************************************
+ * yield_pingpong: two LWPs, main is parked in lwp_wait()
+ *********************************************************/
+
+static int pingpong(void *arg)
+{
+    long timer = (long)arg;
+    int i, j;
+
+    for (i = 0; i < samples; i++)
+    {
+        double start = now_ns();
+        for (j = 0; j < BATCH; j++)
+        {
+            lwp_yield();
+        }
+        // every yield of ours is matched by one from the partner
+        if (timer)
+        {
+            record(current_result, (now_ns() - start) / (2 * BATCH));
+        }
+    }
+    return 0;
+}
+
+static void bench_pingpong(void)
+{
+    current_result = new_result("yield_pingpong", 2);
+    lwp_create(pingpong, (void *)1);
+    lwp_create(pingpong, (void *)0);
+    while (lwp_wait(NULL) != NO_THREAD)
+        ;
+}
+
+/*********************************************************
+ * lifecycle: create, run to exit, reap
+ *********************************************************/
+
+static int noop(void *arg)
+{
+    return 0;
+}
+
+static void bench_lifecycle(void)
+{
+    int i, j;
+
+    current_result = new_result("lifecycle", 1);
+    for (i = 0; i < samples; i++)
+    {
+        double start = now_ns();
+        for (j = 0; j < BATCH; j++)
+        {
+            lwp_create(noop, NULL);
+            lwp_wait(NULL);
+        }
+        record(current_result, (now_ns() - start) / BATCH);
+    }
+}
+
+/*********************************************************
+ * yield_N: N LWPs yielding round robin, timed across all of them
+ *********************************************************/
+
+static int spinner(void *arg)
+{
+    // one untimed round first, so fresh stacks fault in before the clock starts
+    lwp_yield();
+    while (!stop)
+    {
+        if (yield_count == 0)
+        {
+            batch_start = now_ns(); // everyone is back from the warm-up round
+        }
+        if (++yield_count % BATCH == 0)
+        {
+            double t = now_ns();
+            record(current_result, (t - batch_start) / BATCH);
+            batch_start = t;
+            if (current_result->count == samples)
+            {
+                stop = 1;
+            }
+        }
+        lwp_yield(); // counted before switching, so no sample spans a whole round
+    }
+    return 0;
+}
+
+static void bench_yield(long n)
+{
+    lwp_attr attr = {LWP_ATTR_ARENA, BENCH_STACK, 0};
+    char name[32];
+    long i;
+
+    snprintf(name, sizeof(name), "yield_%ld", n);
+    current_result = new_result(name, n);
+    stop = 0;
+    yield_count = 0;
+    for (i = 0; i < n; i++)
+    {
+        lwp_create_attr(spinner, NULL, &attr);
+    }
+    while (lwp_wait(NULL) != NO_THREAD)
+        ;
+}
+
+/*********************************************************
+ * swap_rfiles: save and reload the same register file
+ *********************************************************/
+
+static void bench_swap(void)
+{
+    rfile self;
+    int i, j;
+
+    current_result = new_result("swap_rfiles", 0);
+    for (i = 0; i < samples; i++)
+    {
+        double start = now_ns();
+        for (j = 0; j < BATCH; j++)
+        {
+            swap_rfiles(&self, &self);
+        }
+        record(current_result, (now_ns() - start) / BATCH);
+    }
+}
+
+/*********************************************************
+ * reporting
+ *********************************************************/
+
+static void report(const char *path)
+{
+    FILE *out;
+    int i;
+
+    printf("%-16s %8s %8s %10s %10s %10s %10s %10s\n", "benchmark", "threads", "samples", "mean", "p50", "p99", "p999", "max");
+    for (i = 0; i < nresults; i++)
+    {
+        result *r = &results[i];
+        qsort(r->ns, r->count, sizeof(double), cmp_double);
+        printf("%-16s %8ld %8d %10.1f %10.1f %10.1f %10.1f %10.1f\n", r->name, r->threads, r->count,
+               mean(r), percentile(r, 50), percentile(r, 99), percentile(r, 99.9), r->ns[r->count - 1]);
+    }
+    printf("(ns/op, %d ops per sample)\n", BATCH);
+
+    out = fopen(path, "w");
+    if (out == NULL)
+    {
+        perror(path);
+        exit(EXIT_FAILURE);
+    }
+    fprintf(out, "{\n  \"unit\": \"ns/op\",\n  \"batch\": %d,\n  \"benchmarks\": [\n", BATCH);
+    for (i = 0; i < nresults; i++)
+    {
+        result *r = &results[i];
+        fprintf(out, "    {\"name\": \"%s\", \"threads\": %ld, \"samples\": %d, "
+                     "\"mean\": %.2f, \"min\": %.2f, \"p50\": %.2f, \"p90\": %.2f, "
+                     "\"p99\": %.2f, \"p999\": %.2f, \"max\": %.2f}%s\n",
+                r->name, r->threads, r->count, mean(r), r->ns[0], percentile(r, 50), percentile(r, 90),
+                percentile(r, 99), percentile(r, 99.9), r->ns[r->count - 1], i + 1 < nresults ? "," : "");
+    }
+    fprintf(out, "  ]\n}\n");
+    fclose(out);
+    printf("wrote %s\n", path);
+}
+
+int main(int argc, char *argv[])
+{
+    const char *path = "bench.json";
+    char sizes[256] = "10,1000,100000";
+    long n, most = 0;
+    char *tok, *end;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "o:s:n:")) != -1)
+    {
+        switch (opt)
+        {
+        case 'o':
+            path = optarg;
+            break;
+        case 's':
+            samples = atoi(optarg);
+            break;
+        case 'n':
+            snprintf(sizes, sizeof(sizes), "%s", optarg);
+            break;
+        default:
+            fprintf(stderr, "usage: %s [-o file.json] [-s samples] [-n N[,N...]]\n", argv[0]);
+            exit(EXIT_FAILURE);
+        }
+    }
+    if (samples < 1)
+    {
+        samples = 1;
+    }
+
+    // one arena big enough for the largest yield_N, so N stacks are N slots and not N mappings
+    for (tok = sizes; *tok != '\0'; tok = (*end == ',') ? end + 1 : end)
+    {
+        n = strtol(tok, &end, 10);
+        if (end == tok)
+        {
+            break;
+        }
+        if (n > most)
+        {
+            most = n;
+        }
+    }
+    if (most > 0)
+    {
+        lwp_arena_init(most, BENCH_STACK);
+    }
+
+    // main becomes an LWP up front and stays one for all the benchmarks
+    lwp_start();
+
+    bench_swap();
+    bench_pingpong();
+    bench_lifecycle();
+    for (tok = strtok(sizes, ","); tok != NULL && nresults < MAX_RESULTS; tok = strtok(NULL, ","))
+    {
+        bench_yield(atol(tok));
+    }
+
+    report(path);
+    return 0;
+}
@@ -0,0 +1,220 @@
+#define _GNU_SOURCE
+#include "lwp.h"
+#include "stacks.h"
+#include "fcfs.h"
+#include <stdlib.h>
+#include <string.h>
+#include <dlfcn.h>
+
+/* Introspection: walk every thread the library knows about and say what it
+ * is doing, without admitting, removing or switching anything. */
+
+extern scheduler schedule;
+extern scheduler RoundRobin;
+extern thread current;
+extern thread all_threads;
+
+const char *lwp_sched_name(scheduler s)
+{
+    /* a printable name for the schedulers that come with the library */
+    if (s == NULL)
+    {
+        return "none";
+    }
+    if (s == RoundRobin)
+    {
+        return "RoundRobin";
+    }
+    if (s == FirstComeFirstServe)
+    {
+        return "FirstComeFirstServe";
+    }
+    return "scheduler";
+}
+
+static int read_word(thread t, unsigned long lo, unsigned long hi, unsigned long addr, unsigned long *out)
+{
+    /* *out = the word t has at addr, if addr is on t's stack. A copy-stack
+    thread that isn't on its shared stack right now has its frames in its
+    save area instead, where the top of the stack is the end of the buffer */
+    if (addr % sizeof(unsigned long) != 0)
+    {
+        return 0;
+    }
+    if (t->shared != NULL && t->shared->owner != t)
+    {
+        unsigned long base = hi - t->savelen;
+        if (addr < base || addr + sizeof(unsigned long) > hi)
+        {
+            return 0;
+        }
+        memcpy(out, (char *)t->save + (addr - base), sizeof(unsigned long));
+        return 1;
+    }
+    if (addr < lo || addr + sizeof(unsigned long) > hi)
+    {
+        return 0;
+    }
+    *out = *(unsigned long *)addr;
+    return 1;
+}
+
+static void backtrace_from(thread t, unsigned long fp, lwp_info *info)
+{
+    // [saved rbp][return address] frames, stopping at the first one off the stack
+    unsigned long lo, hi, next, ret;
+
+    stack_bounds(t, &lo, &hi);
+    info->depth = 0;
+    while (info->depth < LWP_BACKTRACE_MAX && read_word(t, lo, hi, fp + sizeof(unsigned long), &ret) && ret != 0)
+    {
+        info->backtrace[info->depth++] = ret;
+        if (!read_word(t, lo, hi, fp, &next) || next <= fp)
+        {
+            break;
+        }
+        fp = next;
+    }
+}
+
+static void snapshot(thread t, lwp_info *info)
+{
+    unsigned long lo, hi;
+
+    memset(info, 0, sizeof(*info));
+    info->tid = t->tid;
+    info->state = t->runstate;
+    info->fun = t->fun;
+    info->status = t->status;
+    info->stacksize = t->stacksize;
+    info->stackpeak = t->stackpeak;
+    switch (t->runstate)
+    {
+    case LWP_STATE_BLOCKED:
+        info->queue = t->blockedon != NULL ? t->blockedon : "blocked";
+        break;
+    case LWP_STATE_TERMINATED:
+        // who will reap it
+        info->queue = t->joinable ? "lwp_join" : t->scope != NULL ? "lwp_scope" : "terminated";
+        break;
+    default:
+        info->queue = lwp_sched_name(schedule);
+    }
+
+    stack_bounds(t, &lo, &hi);
+    if (t == current)
+    {
+        // still running, so the saved registers are stale: walk from right here
+        unsigned long fp = (unsigned long)__builtin_frame_address(0);
+        info->stackused = hi > fp ? hi - fp : 0;
+        backtrace_from(t, fp, info);
+        return;
+    }
+    if (LWPTERMINATED(t->status) || t->step != NULL)
+    {
+        return; // its frames are gone, or about to be. A parked stackless one has none
+    }
+    // swap_rfiles() saved rbp at its own frame, whose return address is where t resumes
+    info->rsp = t->state.rsp;
+    info->stackused = hi > info->rsp ? hi - info->rsp : 0;
+    backtrace_from(t, t->state.rbp, info);
+    if (info->depth > 0)
+    {
+        info->rip = info->backtrace[0];
+    }
+}
+
+long lwp_foreach(int (*fn)(const lwp_info *, void *), void *arg)
+{
+    /* call fn once for every thread not yet reaped, newest first, in a single
+    pass over the registry. fn must not create, switch to or reap threads.
+    Stops early if fn returns non-zero. Returns the number of threads seen */
+    lwp_info info;
+    thread t;
+    long count = 0;
+
+    stack_bounds_init();
+    for (t = all_threads; t != NULL; t = t->all_next)
+    {
+        snapshot(t, &info);
+        count++;
+        if (fn(&info, arg))
+        {
+            break;
+        }
+    }
+    return count;
+}
+
+static void print_pc(FILE *out, unsigned long pc)
+{
+    // symbol+offset when the dynamic symbol table knows it, else module+offset
+    Dl_info dl;
+    int found = dladdr((void *)pc, &dl); // dl is untouched when it fails
+
+    if (found && dl.dli_sname != NULL)
+    {
+        fprintf(out, "%s+0x%lx", dl.dli_sname, pc - (unsigned long)dl.dli_saddr);
+    }
+    else if (found && dl.dli_fname != NULL && dl.dli_fbase != NULL)
+    {
+        const char *name = strrchr(dl.dli_fname, '/');
+        fprintf(out, "%s+0x%lx", name != NULL ? name + 1 : dl.dli_fname, pc - (unsigned long)dl.dli_fbase);
+    }
+    else
+    {
+        fprintf(out, "0x%lx", pc);
+    }
+}
+
+static int dump_one(const lwp_info *info, void *arg)
+{
+    static const char *states[] = {"ready", "running", "blocked", "terminated"};
+    FILE *out = arg;
+    int i;
+
+    fprintf(out, "tid %-6lu %-10s on %-20s ", info->tid, states[info->state], info->queue);
+    if (info->fun != NULL)
+    {
+        print_pc(out, (unsigned long)info->fun);
+    }
+    else
+    {
+        fputs("main", out);
+    }
+    if (info->state == LWP_STATE_TERMINATED)
+    {
+        fprintf(out, "  status %d\n", LWPTERMSTAT(info->status));
+        return 0;
+    }
+    fprintf(out, "  stack %zu/%zu", info->stackused, info->stacksize);
+    if (info->stackpeak != 0)
+    {
+        fprintf(out, " peak %zu", info->stackpeak);
+    }
+    if (info->rsp != 0)
+    {
+        fprintf(out, "  rsp 0x%lx rip 0x%lx", info->rsp, info->rip);
+    }
+    fputc('\n', out);
+    for (i = 0; i < info->depth; i++)
+    {
+        fprintf(out, "    #%-2d 0x%016lx ", i, info->backtrace[i]);
+        print_pc(out, info->backtrace[i]);
+        fputc('\n', out);
+    }
+    return 0;
+}
+
+void lwp_dump(FILE *out)
+{
+    /* print every thread's state, queue, stack use and backtrace to out. Safe
+    to call from any lwp at any time, e.g. from a watchdog when things stall */
+    long count;
+
+    fprintf(out, "lwp: scheduler %s, %d ready\n", lwp_sched_name(schedule),
+            schedule != NULL ? schedule->qlen() : 0);
+    count = lwp_foreach(dump_one, out);
+    fprintf(out, "lwp: %ld threads\n", count);
+    fflush(out);
+}
@@ -7,7 +7,7 @@
 #include "thread_list.h"
 
 
-scheduler FirstComeFirstServe = &(struct scheduler_){ fcfs_init, fcfs_shutdown, fcfs_admit, fcfs_remove, fcfs_next, fcfs_qlen };
+scheduler FirstComeFirstServe = &(struct scheduler){ fcfs_init, fcfs_shutdown, fcfs_admit, fcfs_remove, fcfs_next, fcfs_qlen };
 
 static thread_list *container = NULL;
 
@@ -28,6 +28,7 @@ void fcfs_shutdown(void) {
   }
 
   free_thread_list(container);
+  container = NULL;
 }
 
 void fcfs_admit(thread new) {
@@ -47,7 +48,7 @@ void fcfs_remove(thread victim) {
 }
 
 thread fcfs_next(void) {
-  if (!container) {
+  if (!container || !container->root) {
     return NULL;
   }
 
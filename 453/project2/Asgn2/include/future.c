@@ -0,0 +1,361 @@
+#include "lwp.h"
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+
+extern scheduler schedule;
+extern thread current;
+
+// from lwp.c
+void lwp_block(thread t, const char *on, void (*unpark)(thread, void *), void *where);
+void lwp_wake(thread t, thread waker);
+
+void lwp_future_init(lwp_future *f)
+{
+    memset(f, 0, sizeof(*f));
+}
+
+static void unpark_future(thread t, void *where)
+{
+    /* take t off the future's list, for lwp_cancel() */
+    lwp_future *f = where;
+    thread *link = &f->head;
+    thread prev = NULL;
+
+    while (*link != t)
+    {
+        prev = *link;
+        link = &(*link)->lib_one;
+    }
+    *link = t->lib_one;
+    if (f->tail == t)
+    {
+        f->tail = prev;
+    }
+    t->lib_one = NULL;
+}
+
+int lwp_future_get(lwp_future *f, void **value)
+{
+    /* park until f has a value, then put it in *value (if not NULL). Returns
+    0, or -1 if it can never get one because nothing else can run */
+    if (!f->ready)
+    {
+        if (current == NULL || schedule->qlen() <= 1)
+        {
+            return -1;
+        }
+        current->lib_one = NULL;
+        if (f->tail == NULL)
+        {
+            f->head = current;
+        }
+        else
+        {
+            f->tail->lib_one = current;
+        }
+        f->tail = current;
+        lwp_block(current, "lwp_future", unpark_future, f);
+    }
+    if (value != NULL)
+    {
+        *value = f->value;
+    }
+    return 0;
+}
+
+int lwp_promise_set(lwp_promise *p, void *value)
+{
+    /* give the future its value and readmit everything parked on it, oldest
+    first. Returns 0, or -1 if it already had one */
+    thread t;
+
+    if (p->ready)
+    {
+        return -1;
+    }
+    p->value = value;
+    p->ready = 1;
+    while ((t = p->head) != NULL)
+    {
+        p->head = t->lib_one;
+        t->lib_one = NULL;
+        lwp_wake(t, current);
+    }
+    p->tail = NULL;
+    return 0;
+}
+
+// TASK GRAPHS
+
+#define GRAPH_CHUNK 4096
+
+typedef struct graph_chunk {
+    struct graph_chunk *next;
+} graph_chunk;
+
+typedef struct graph_edge {
+    lwp_node *to;
+    struct graph_edge *next;
+} graph_edge;
+
+struct lwp_node {
+    lwpfun fn;
+    void *arg;
+    lwp_graph *graph;
+    graph_edge *out;    // nodes that depend on this one
+    int indegree;       // edges in
+    int pending;        // of those, not finished yet this run
+    int skipped;        // something it depends on failed
+    int status;
+    tid_t tid;          // NO_THREAD until launched
+    lwp_node *next;     // every node in the graph, newest first
+};
+
+struct lwp_graph {
+    graph_chunk *chunks;
+    char *bump;         // next free byte in chunks
+    char *limit;
+    lwp_node *nodes;
+    long count;
+    long remaining;     // nodes not finished this run
+    long failed;        // failed or skipped this run
+    lwp_future done;    // set when remaining hits 0
+};
+
+static void *graph_alloc(lwp_graph *g, size_t size)
+{
+    /* bump allocate from the graph's arena, NULL if out of memory */
+    void *p;
+
+    size = (size + 15) & ~(size_t)15;
+    if (g->bump == NULL || (size_t)(g->limit - g->bump) < size)
+    {
+        size_t chunksize = GRAPH_CHUNK;
+        graph_chunk *c;
+        while (chunksize - 16 < size)
+        {
+            chunksize *= 2;
+        }
+        c = malloc(chunksize);
+        if (c == NULL)
+        {
+            perror("Error allocating graph arena");
+            return NULL;
+        }
+        c->next = g->chunks;
+        g->chunks = c;
+        g->bump = (char *)c + 16; // keeps the blocks 16 aligned
+        g->limit = (char *)c + chunksize;
+    }
+    p = g->bump;
+    g->bump += size;
+    return p;
+}
+
+lwp_graph *lwp_graph_create(void)
+{
+    /* an empty graph, NULL if out of memory */
+    lwp_graph *g = calloc(1, sizeof(lwp_graph));
+    if (g == NULL)
+    {
+        perror("Error allocating graph");
+    }
+    return g;
+}
+
+lwp_node *lwp_graph_node(lwp_graph *g, lwpfun fn, void *arg)
+{
+    /* a node that runs fn(arg), returning non-zero counts as failing */
+    lwp_node *n = graph_alloc(g, sizeof(lwp_node));
+    if (n == NULL)
+    {
+        return NULL;
+    }
+    memset(n, 0, sizeof(*n));
+    n->fn = fn;
+    n->arg = arg;
+    n->graph = g;
+    n->next = g->nodes;
+    g->nodes = n;
+    g->count++;
+    return n;
+}
+
+int lwp_graph_edge(lwp_graph *g, lwp_node *before, lwp_node *after)
+{
+    /* after can't start until before has finished. Returns 0, or -1 if out of memory */
+    graph_edge *e = graph_alloc(g, sizeof(graph_edge));
+    if (e == NULL)
+    {
+        return -1;
+    }
+    e->to = after;
+    e->next = before->out;
+    before->out = e;
+    after->indegree++;
+    return 0;
+}
+
+static void node_launch(lwp_node *n);
+
+static void node_finish(lwp_node *n)
+{
+    /* count n as done and launch whatever that leaves with nothing to wait for */
+    lwp_graph *g = n->graph;
+    int bad = n->skipped || n->status != 0;
+    graph_edge *e;
+
+    if (bad)
+    {
+        g->failed++;
+    }
+    for (e = n->out; e != NULL; e = e->next)
+    {
+        e->to->skipped |= bad;
+        if (--e->to->pending == 0)
+        {
+            node_launch(e->to);
+        }
+    }
+    if (--g->remaining == 0)
+    {
+        lwp_promise_set(&g->done, NULL);
+    }
+}
+
+static void node_cancelled(void *arg)
+{
+    /* a node's thread was cancelled, count it as failed so the graph still finishes */
+    lwp_node *n = arg;
+    n->status = -1;
+    node_finish(n);
+}
+
+static int node_run(void *place)
+{
+    /* the thread for one node, place holds the node */
+    lwp_node *n = *(lwp_node **)place;
+    lwp_cleanup cleanup;
+
+    lwp_cleanup_push(&cleanup, node_cancelled, n);
+    n->status = n->fn(n->arg);
+    lwp_cleanup_pop(0);
+    node_finish(n);
+    return n->status;
+}
+
+static void node_launch(lwp_node *n)
+{
+    /* start n on its own thread, or skip it if something before it failed */
+    void *place;
+
+    if (!n->skipped)
+    {
+        // joinable, so the graph reaps it and lwp_wait() never sees it
+        n->tid = lwp_create_inplace(node_run, NULL, sizeof(lwp_node *), &place, NULL);
+        if (n->tid != NO_THREAD)
+        {
+            *(lwp_node **)place = n;
+            return;
+        }
+        n->status = -1;
+    }
+    node_finish(n);
+}
+
+static int graph_acyclic(lwp_graph *g)
+{
+    /* Kahn's algorithm on the pending counts, 1 if every node can be reached */
+    lwp_node *n, *ready = NULL;
+    graph_edge *e;
+    long seen = 0;
+
+    for (n = g->nodes; n != NULL; n = n->next)
+    {
+        n->pending = n->indegree;
+    }
+    // roots go on a stack linked through tid, which run() resets anyway
+    for (n = g->nodes; n != NULL; n = n->next)
+    {
+        if (n->pending == 0)
+        {
+            n->tid = (tid_t)ready;
+            ready = n;
+        }
+    }
+    while (ready != NULL)
+    {
+        n = ready;
+        ready = (lwp_node *)n->tid;
+        seen++;
+        for (e = n->out; e != NULL; e = e->next)
+        {
+            if (--e->to->pending == 0)
+            {
+                e->to->tid = (tid_t)ready;
+                ready = e->to;
+            }
+        }
+    }
+    return seen == g->count;
+}
+
+long lwp_graph_run(lwp_graph *g)
+{
+    /* run every node, each as soon as the ones before it are done, and wait
+    for them all. Nodes after one that failed are skipped. Returns how many
+    failed or were skipped, or -1 for a cycle or if called outside an LWP.
+    A graph can be run again */
+    lwp_node *n;
+
+    if (g->count == 0)
+    {
+        return 0;
+    }
+    if (current == NULL || !graph_acyclic(g))
+    {
+        return -1;
+    }
+    for (n = g->nodes; n != NULL; n = n->next)
+    {
+        n->pending = n->indegree;
+        n->skipped = 0;
+        n->status = 0;
+        n->tid = NO_THREAD;
+    }
+    lwp_future_init(&g->done);
+    g->remaining = g->count;
+    g->failed = 0;
+    for (n = g->nodes; n != NULL; n = n->next)
+    {
+        if (n->indegree == 0)
+        {
+            node_launch(n);
+        }
+    }
+    lwp_future_get(&g->done, NULL);
+
+    // they have all exited, this only frees them
+    for (n = g->nodes; n != NULL; n = n->next)
+    {
+        if (n->tid != NO_THREAD)
+        {
+            lwp_join(n->tid, NULL);
+        }
+    }
+    return g->failed;
+}
+
+void lwp_graph_destroy(lwp_graph *g)
+{
+    /* free the graph and every node and edge in it at once */
+    graph_chunk *c, *next;
+
+    for (c = g->chunks; c != NULL; c = next)
+    {
+        next = c->next;
+        free(c);
+    }
+    free(g);
+}
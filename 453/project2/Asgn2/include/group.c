@@ -0,0 +1,316 @@
+#include "lwp.h"
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+
+extern thread current;
+
+// a spawned task waiting on its group's queue
+typedef struct lwp_task {
+    lwpfun fn;
+    void *arg;
+    struct lwp_task *next;
+} lwp_task;
+
+// what a worker finds at the top of its stack, see lwp_create_inplace()
+typedef struct group_place {
+    lwp_task_group *group;
+    int slot;
+} group_place;
+
+// finished task structs, reused before asking malloc for more
+static lwp_task *task_free = NULL;
+
+static lwp_task *group_take(lwp_task_group *g)
+{
+    /* the oldest queued task, or NULL */
+    lwp_task *t = g->head;
+    if (t != NULL)
+    {
+        g->head = t->next;
+        if (g->head == NULL)
+        {
+            g->tail = NULL;
+        }
+        g->queued--;
+    }
+    return t;
+}
+
+static void group_task_cancelled(void *arg)
+{
+    /* the thread running a task was cancelled in it, count it as failed */
+    lwp_task_group *g = arg;
+    g->active--;
+    g->failed++;
+    g->done++;
+}
+
+static void group_run(lwp_task_group *g, lwp_task *t)
+{
+    /* run a task taken off the queue and count how it went */
+    lwpfun fn = t->fn;
+    void *arg = t->arg;
+    lwp_cleanup cleanup;
+    int status;
+
+    t->next = task_free;
+    task_free = t;
+    g->active++;
+    if (current == NULL)
+    {
+        status = fn(arg); // before lwp_start(), nothing can cancel it
+    }
+    else
+    {
+        // otherwise active would stay up and group_start_worker() miscount for good
+        lwp_cleanup_push(&cleanup, group_task_cancelled, g);
+        status = fn(arg);
+        lwp_cleanup_pop(0);
+    }
+    if (status != 0)
+    {
+        g->failed++;
+    }
+    g->active--;
+    g->done++;
+}
+
+static void group_worker_done(void *place)
+{
+    group_place *p = place;
+    p->group->busy[p->slot] = 0;
+    p->group->running--;
+}
+
+static int group_worker(void *place)
+{
+    /* take tasks until the queue is empty, then exit for lwp_task_group_wait()
+    or the next spawn to reap. Nothing yields between finding it empty and
+    clearing busy, so a task can't be queued in between and left behind */
+    group_place *p = place;
+    lwp_task_group *g = p->group;
+    lwp_cleanup cleanup;
+    lwp_task *t;
+
+    lwp_cleanup_push(&cleanup, group_worker_done, p); // also when cancelled
+    while ((t = group_take(g)) != NULL)
+    {
+        group_run(g, t);
+    }
+    lwp_cleanup_pop(1);
+    return 0;
+}
+
+static void group_start_worker(lwp_task_group *g)
+{
+    /* start a worker if the queue holds more tasks than there are workers
+    free to take them, and the group is below LWP_GROUP_WORKERS */
+    group_place *p;
+    void *place;
+    int slot;
+
+    if (g->running >= LWP_GROUP_WORKERS || g->running - g->active >= g->queued)
+    {
+        return;
+    }
+    for (slot = 0; slot < LWP_GROUP_WORKERS; slot++)
+    {
+        if (g->worker[slot] == NO_THREAD)
+        {
+            break;
+        }
+        if (!g->busy[slot])
+        {
+            lwp_join(g->worker[slot], NULL); // it has exited, this only reaps it
+            g->worker[slot] = NO_THREAD;
+            break;
+        }
+    }
+    g->worker[slot] = lwp_create_inplace(group_worker, NULL, sizeof(group_place), &place, g->attr);
+    if (g->worker[slot] == NO_THREAD)
+    {
+        return; // lwp_task_group_wait() runs whatever is left
+    }
+    p = place;
+    p->group = g;
+    p->slot = slot;
+    g->busy[slot] = 1;
+    g->running++;
+}
+
+void lwp_task_group_init(lwp_task_group *g)
+{
+    memset(g, 0, sizeof(*g));
+}
+
+int lwp_task_group_spawn(lwp_task_group *g, lwpfun fn, void *arg)
+{
+    /* queue fn(arg) to run on one of g's workers, starting one if none is
+    free. Returns 0, or -1 if there is no memory for the task */
+    lwp_task *t = task_free;
+
+    if (t != NULL)
+    {
+        task_free = t->next;
+    }
+    else if ((t = malloc(sizeof(lwp_task))) == NULL)
+    {
+        perror("Error allocating task");
+        return -1;
+    }
+    t->fn = fn;
+    t->arg = arg;
+    t->next = NULL;
+    if (g->tail == NULL)
+    {
+        g->head = t;
+    }
+    else
+    {
+        g->tail->next = t;
+    }
+    g->tail = t;
+    g->queued++;
+    group_start_worker(g);
+    return 0;
+}
+
+unsigned long lwp_task_group_wait(lwp_task_group *g)
+{
+    /* run the tasks still queued on the calling thread, then wait for the
+    workers (and anything their tasks spawn). Returns how many tasks returned
+    non-zero and starts the counts over. Called from outside any LWP (before
+    lwp_start()) it can only run the queue, the workers are detached and
+    lwp_wait() reaps them later. So are workers parked in a task with nothing
+    left to run that could wake them; each of those counts as a failure, and
+    g has to outlive them */
+    unsigned long failed;
+    lwp_task *t;
+    int slot, left;
+
+    do
+    {
+        while ((t = group_take(g)) != NULL)
+        {
+            group_run(g, t);
+        }
+        left = 0;
+        for (slot = 0; slot < LWP_GROUP_WORKERS; slot++)
+        {
+            if (g->worker[slot] == NO_THREAD)
+            {
+                continue;
+            }
+            if (current == NULL)
+            {
+                lwp_detach(g->worker[slot]);
+            }
+            else if (lwp_join(g->worker[slot], NULL) == NO_THREAD)
+            {
+                left++; // can't wait for it yet, it has to run first
+                continue;
+            }
+            g->worker[slot] = NO_THREAD;
+        }
+    } while (g->head != NULL || (left > 0 && lwp_get_scheduler()->qlen() > 1));
+
+    // whoever could wake the rest isn't in this process's run queue, don't leak them
+    for (slot = 0; slot < LWP_GROUP_WORKERS && left > 0; slot++)
+    {
+        if (g->worker[slot] != NO_THREAD)
+        {
+            lwp_detach(g->worker[slot]);
+            g->worker[slot] = NO_THREAD;
+            g->failed++;
+        }
+    }
+    failed = g->failed;
+    g->done = 0;
+    g->failed = 0;
+    return failed;
+}
+
+// LWP_PARALLEL_FOR
+
+typedef struct pfor_range {
+    long next;
+    long end;
+    long grain;
+    lwprange fn;
+    void *arg;
+    lwp_task_group *group;
+    long helpers;               // more that may still be started
+} pfor_range;
+
+// what the helpers run on, fn's pieces don't need a full-sized stack
+static const lwp_attr pfor_attr = {0, LWP_PFOR_STACKSIZE, 0};
+
+static int pfor_claim(void *arg)
+{
+    /* keep taking the next grain-sized piece of the range until none are left,
+    so whoever gets to run does the work and nobody holds a fixed share. One
+    helper at a time is kept waiting to start, so a fn that never yields or
+    blocks leaves at most one idle helper behind instead of a whole group */
+    pfor_range *r = arg;
+    long lo, hi;
+
+    while (r->next < r->end)
+    {
+        lo = r->next;
+        hi = r->end - lo > r->grain ? lo + r->grain : r->end;
+        r->next = hi;
+        if (hi < r->end && r->helpers > 0 && r->group->queued == 0)
+        {
+            // none is waiting to start, line one up in case fn parks
+            r->helpers--;
+            lwp_task_group_spawn(r->group, pfor_claim, r);
+        }
+        r->fn(lo, hi, r->arg);
+    }
+    return 0;
+}
+
+int lwp_parallel_for(long begin, long end, long grain, lwprange fn, void *arg)
+{
+    /* call fn(lo, hi, arg) over pieces of [begin, end) about grain long (0
+    picks one), then return once all of them have been done. The caller works
+    through the range too, helpers (up to LWP_GROUP_WORKERS, on
+    LWP_PFOR_STACKSIZE stacks) only get pieces while fn blocks or yields.
+    Returns 0, or -1 for a bad range */
+    lwp_task_group g;
+    pfor_range r;
+    long chunks;
+
+    if (fn == NULL || begin > end || grain < 0)
+    {
+        return -1;
+    }
+    if (grain == 0)
+    {
+        grain = (end - begin) / (8 * LWP_GROUP_WORKERS);
+        if (grain == 0)
+        {
+            grain = 1;
+        }
+    }
+    lwp_task_group_init(&g);
+    g.attr = &pfor_attr;
+    r.next = begin;
+    r.end = end;
+    r.grain = grain;
+    r.fn = fn;
+    r.arg = arg;
+    r.group = &g;
+
+    chunks = (end - begin) / grain + ((end - begin) % grain != 0);
+    r.helpers = chunks - 1 < LWP_GROUP_WORKERS ? chunks - 1 : LWP_GROUP_WORKERS;
+    if (current == NULL || current->shared != NULL)
+    {
+        // nothing could wait for them, or r moves off its address while we're parked
+        r.helpers = 0;
+    }
+    pfor_claim(&r);
+    lwp_task_group_wait(&g);
+    return 0;
+}
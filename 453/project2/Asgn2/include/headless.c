@@ -0,0 +1,275 @@
+/*
+ * headless: the snake demos as a repeatable macro-benchmark.
+ *
+ * Same shape of workload as randomsnakes/hungrysnakes, one LWP per snake
+ * that moves a step and yields, but on an in-memory board with no curses,
+ * no TTY and no delay. Each snake is seeded from its index, so a given
+ * command line always plays the same game whatever the scheduler.
+ *
+ *   random   snakes wander, turning now and then and steering around bodies
+ *   hungry   snakes turn onto food when a few random probes of the cells
+ *            around the head find some, and grow when they eat it
+ *
+ * Every scheduler plays the same game with the same yields. FCFS never
+ * rotates, a yield just comes back to the same snake, so under fcfs the
+ * snakes run one after another and its steps/s is the cost of yields
+ * that don't switch, reported as it comes out.
+ *
+ * usage: snakebench [-s rr|fcfs] [-w random|hungry] [-n snakes] [-t steps]
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+#include "lwp.h"
+#include "fcfs.h"
+#include "snakes.h"
+
+#define CELLS_PER_SNAKE 64              // board area grows with the snake count
+#define START_LEN       10
+#define MAX_LEN         64
+#define FOOD_PER_SNAKE  2
+#define SNAKE_STACK     (32 * 1024)
+
+extern scheduler RoundRobin;
+
+typedef struct body {
+    sn_point      cell[MAX_LEN];        // ring buffer, head at cell[head]
+    int           head;
+    int           len;
+    direction     dir;
+    unsigned long seed;
+    int           steps;
+} body;
+
+static int width, height;
+static unsigned char *board;            // snakes covering each cell
+static unsigned char *food;
+static int hungry = 0;
+static int steps_per_snake = 10000;
+static unsigned long total_steps = 0;
+
+static const int dx[NUMDIRS] = {-1, 0, 1, -1, 1, -1, 0, 1};
+static const int dy[NUMDIRS] = {-1, -1, -1, 0, 0, 1, 1, 1};
+
+static unsigned long rnd(unsigned long *seed)
+{
+    // xorshift64, private to each snake so schedules can't change the game
+    *seed ^= *seed << 13;
+    *seed ^= *seed >> 7;
+    *seed ^= *seed << 17;
+    return *seed;
+}
+
+static sn_point step_from(sn_point p, direction d)
+{
+    // the board wraps at the edges
+    p.x = (p.x + dx[d] + width) % width;
+    p.y = (p.y + dy[d] + height) % height;
+    return p;
+}
+
+static int cell(sn_point p)
+{
+    return p.y * width + p.x;
+}
+
+static direction toward_food(body *b)
+{
+    // greedy: the first of a few random probes that lands on food, else keep going
+    sn_point h = b->cell[b->head];
+    int tries, d;
+
+    for (tries = 0; tries < 4; tries++)
+    {
+        d = rnd(&b->seed) % NUMDIRS;
+        if (food[cell(step_from(h, d))])
+        {
+            return d;
+        }
+    }
+    return b->dir;
+}
+
+static void move_snake(body *b)
+{
+    sn_point h = b->cell[b->head];
+    sn_point next;
+    int tries, grow = 0;
+
+    if (hungry)
+    {
+        b->dir = toward_food(b);
+    }
+    else if (rnd(&b->seed) % 8 == 0)
+    {
+        b->dir = rnd(&b->seed) % NUMDIRS;
+    }
+
+    // steer around other bodies, give up after a few tries and pile on
+    next = step_from(h, b->dir);
+    for (tries = 0; tries < NUMDIRS && board[cell(next)]; tries++)
+    {
+        b->dir = (b->dir + 1) % NUMDIRS;
+        next = step_from(h, b->dir);
+    }
+
+    if (hungry && food[cell(next)])
+    {
+        // eat it, and put a new one somewhere else
+        food[cell(next)] = 0;
+        food[rnd(&b->seed) % (width * height)] = 1;
+        grow = b->len < MAX_LEN;
+    }
+
+    if (!grow)
+    {
+        int tail = (b->head - b->len + 1 + MAX_LEN) % MAX_LEN;
+        board[cell(b->cell[tail])]--;
+    }
+    else
+    {
+        b->len++;
+    }
+    b->head = (b->head + 1) % MAX_LEN;
+    b->cell[b->head] = next;
+    board[cell(next)]++;
+}
+
+static int run_headless_snake(void *arg)
+{
+    body *b = arg;
+    int i;
+
+    for (i = 0; i < steps_per_snake; i++)
+    {
+        move_snake(b);
+        b->steps++;
+        lwp_yield(); // let another have a turn
+    }
+    return 0;
+}
+
+static void place_snake(body *b, int index)
+{
+    // lay the snake out in a straight line from a seeded random start
+    sn_point p;
+    int i;
+
+    memset(b, 0, sizeof(*b));
+    b->seed = 0x9e3779b97f4a7c15UL * (index + 1);
+    b->dir = rnd(&b->seed) % NUMDIRS;
+    p.x = rnd(&b->seed) % width;
+    p.y = rnd(&b->seed) % height;
+    for (i = 0; i < START_LEN; i++)
+    {
+        b->cell[i] = p;
+        board[cell(p)]++;
+        p = step_from(p, b->dir);
+    }
+    b->head = START_LEN - 1;
+    b->len = START_LEN;
+}
+
+static double now_sec(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+int main(int argc, char *argv[])
+{
+    lwp_attr attr = {LWP_ATTR_ARENA, SNAKE_STACK, 0};
+    const char *sched_name = "rr";
+    scheduler sched = RoundRobin;
+    int nsnakes = 1000;
+    body *snakes;
+    double start, elapsed;
+    int i, opt;
+
+    while ((opt = getopt(argc, argv, "s:w:n:t:")) != -1)
+    {
+        switch (opt)
+        {
+        case 's':
+            sched_name = optarg;
+            if (strcmp(optarg, "rr") == 0)
+            {
+                sched = RoundRobin;
+            }
+            else if (strcmp(optarg, "fcfs") == 0)
+            {
+                sched = FirstComeFirstServe;
+            }
+            else
+            {
+                fprintf(stderr, "%s: unknown scheduler %s\n", argv[0], optarg);
+                exit(EXIT_FAILURE);
+            }
+            break;
+        case 'w':
+            hungry = strcmp(optarg, "hungry") == 0;
+            break;
+        case 'n':
+            nsnakes = atoi(optarg);
+            break;
+        case 't':
+            steps_per_snake = atoi(optarg);
+            break;
+        default:
+            fprintf(stderr, "usage: %s [-s rr|fcfs] [-w random|hungry] [-n snakes] [-t steps]\n", argv[0]);
+            exit(EXIT_FAILURE);
+        }
+    }
+    if (nsnakes < 1)
+    {
+        nsnakes = 1;
+    }
+
+    // roughly square board, never smaller than the curses one
+    for (width = 80; width * width / 2 < nsnakes * CELLS_PER_SNAKE; width *= 2)
+        ;
+    height = width / 2 < 24 ? 24 : width / 2;
+    board = calloc(width * height, 1);
+    food = calloc(width * height, 1);
+    snakes = malloc(nsnakes * sizeof(body));
+    if (board == NULL || food == NULL || snakes == NULL)
+    {
+        perror("malloc");
+        exit(EXIT_FAILURE);
+    }
+    if (hungry)
+    {
+        unsigned long seed = 42;
+        for (i = 0; i < nsnakes * FOOD_PER_SNAKE; i++)
+        {
+            food[rnd(&seed) % (width * height)] = 1;
+        }
+    }
+
+    lwp_arena_init(nsnakes, SNAKE_STACK);
+    lwp_set_scheduler(sched);
+    for (i = 0; i < nsnakes; i++)
+    {
+        place_snake(&snakes[i], i);
+        lwp_create_attr(run_headless_snake, &snakes[i], &attr);
+    }
+
+    start = now_sec();
+    lwp_start();
+    while (lwp_wait(NULL) != NO_THREAD)
+        ;
+    elapsed = now_sec() - start;
+
+    for (i = 0; i < nsnakes; i++)
+    {
+        total_steps += snakes[i].steps;
+    }
+    printf("%-6s %-7s snakes %6d board %4dx%-4d steps %10lu  %8.3f s  %12.0f steps/s\n",
+           sched_name, hungry ? "hungry" : "random", nsnakes, width, height, total_steps, elapsed,
+           total_steps / elapsed);
+    return 0;
+}
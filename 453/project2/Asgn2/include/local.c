@@ -0,0 +1,174 @@
+#include "lwp.h"
+#include "local.h"
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+
+extern thread current;
+extern thread all_threads;
+
+// what keys are in use, and what to call on their values when a thread exits
+static unsigned char key_used[LWP_KEYS_MAX];
+static void (*key_destructor[LWP_KEYS_MAX])(void *);
+
+// values set before lwp_start(), the original thread takes them over
+static context before_start;
+
+static void **local_slot(thread t, lwp_key_t key, int grow)
+{
+    /* where t keeps key's value, NULL if it has nowhere yet and grow is 0 */
+    if (key < LWP_LOCAL_INLINE)
+    {
+        return &t->local[key];
+    }
+    if (t->local_more == NULL)
+    {
+        if (!grow)
+        {
+            return NULL;
+        }
+        t->local_more = calloc(LWP_KEYS_MAX - LWP_LOCAL_INLINE, sizeof(void *));
+        if (t->local_more == NULL)
+        {
+            perror("Error allocating lwp-local table");
+            return NULL;
+        }
+    }
+    return &t->local_more[key - LWP_LOCAL_INLINE];
+}
+
+int lwp_key_create(lwp_key_t *key, void (*destructor)(void *))
+{
+    /* a new key, NULL in every thread until set. destructor (may be NULL) is
+    called on a thread's non-NULL value when it exits. Returns 0, or -1 if
+    all LWP_KEYS_MAX are taken */
+    lwp_key_t k;
+    thread t;
+
+    for (k = 0; k < LWP_KEYS_MAX && key_used[k]; k++)
+    {
+    }
+    if (k == LWP_KEYS_MAX)
+    {
+        return -1;
+    }
+    // a deleted key may have left values behind
+    for (t = all_threads; t != NULL; t = t->all_next)
+    {
+        void **slot = local_slot(t, k, 0);
+        if (slot != NULL)
+        {
+            *slot = NULL;
+        }
+    }
+    if (current == NULL)
+    {
+        void **slot = local_slot(&before_start, k, 0);
+        if (slot != NULL)
+        {
+            *slot = NULL;
+        }
+    }
+    key_used[k] = 1;
+    key_destructor[k] = destructor;
+    *key = k;
+    return 0;
+}
+
+int lwp_key_delete(lwp_key_t key)
+{
+    /* free key for reuse, no destructors run. Returns 0, or -1 if it isn't in use */
+    if (key >= LWP_KEYS_MAX || !key_used[key])
+    {
+        return -1;
+    }
+    key_used[key] = 0;
+    key_destructor[key] = NULL;
+    return 0;
+}
+
+void *lwp_getspecific(lwp_key_t key)
+{
+    /* the calling thread's value for key */
+    thread t = current != NULL ? current : &before_start;
+
+    if (key < LWP_LOCAL_INLINE)
+    {
+        return t->local[key];
+    }
+    if (key >= LWP_KEYS_MAX || t->local_more == NULL)
+    {
+        return NULL;
+    }
+    return t->local_more[key - LWP_LOCAL_INLINE];
+}
+
+int lwp_setspecific(lwp_key_t key, const void *value)
+{
+    /* set the calling thread's value for key. Returns 0, or -1 for a bad key
+    or if there is no memory for it */
+    thread t = current != NULL ? current : &before_start;
+    void **slot;
+
+    if (key >= LWP_KEYS_MAX || !key_used[key])
+    {
+        return -1;
+    }
+    slot = local_slot(t, key, value != NULL);
+    if (slot == NULL)
+    {
+        return value != NULL ? -1 : 0;
+    }
+    *slot = (void *)value;
+    return 0;
+}
+
+void local_exit(thread t)
+{
+    /* run the destructors for t's values, on t's stack as it exits. Each value
+    is cleared before its destructor sees it, so one set again gets another round */
+    int round, again;
+    lwp_key_t k;
+
+    for (round = 0; round < LOCAL_DESTRUCTOR_ROUNDS; round++)
+    {
+        again = 0;
+        for (k = 0; k < LWP_KEYS_MAX; k++)
+        {
+            void **slot;
+            void *value;
+            if (k == LWP_LOCAL_INLINE && t->local_more == NULL)
+            {
+                break;
+            }
+            slot = local_slot(t, k, 0);
+            if (*slot == NULL || !key_used[k] || key_destructor[k] == NULL)
+            {
+                continue;
+            }
+            value = *slot;
+            *slot = NULL;
+            key_destructor[k](value);
+            again = 1;
+        }
+        if (!again)
+        {
+            break;
+        }
+    }
+}
+
+void local_free(thread t)
+{
+    /* t is being reaped */
+    free(t->local_more);
+    t->local_more = NULL;
+}
+
+void local_adopt(thread t)
+{
+    /* lwp_start(): the original thread keeps what it set before */
+    memcpy(t->local, before_start.local, sizeof(t->local));
+    t->local_more = before_start.local_more;
+    memset(&before_start, 0, sizeof(before_start));
+}
@@ -0,0 +1,13 @@
+#ifndef LOCAL_H
+#define LOCAL_H
+
+#include "lwp.h"
+
+// rounds of destructors at exit, values set by a destructor get this many more chances
+#define LOCAL_DESTRUCTOR_ROUNDS 4
+
+void local_exit(thread t);
+void local_free(thread t);
+void local_adopt(thread t);
+
+#endif
@@ -1,7 +1,16 @@
 #include "lwp.h"
+#include "stacks.h"
+#include "stats.h"
+#include "trace.h"
+#include "probes.h"
+#include "statpage.h"
+#include "replay.h"
+#include "local.h"
+#include "scratch.h"
 #include <stdlib.h>
 #include <unistd.h>
 #include <stdio.h>
+#include <string.h>
 #include <sys/resource.h>
 #define _GNU_SOURCE
 #include <sys/mman.h>
@@ -16,21 +25,34 @@ thread head = NULL; // head of the thread pool, using the sched_one pointer
 // the thread we are currently executing should be at the back of the list
 
 thread terminated = NULL; // list of terminated threads, using the exited pointer
+thread terminated_tail = NULL; // last of them, so exiting doesn't walk the list
 
 thread waiting = NULL; // list of waiting threads, using the lib_one pointer
 
+// every thread from creation until it is reaped, linked through all_next/all_prev
+thread all_threads = NULL;
+
 // global thread id counter
 int tid_counter = 2;
 
 
 // Keep track of the TID of the currently executing thread
 tid_t current_running_thread_tid = 1;
+// and the thread itself, so the hot paths don't have to look it up
+thread current = NULL;
 
 // RR SCHEDULER STUFF BELOW:
+// the pool is doubly linked (sched_one forward, sched_two back) with a tail
+// pointer and a count, so admit, remove, next and qlen are all O(1)
+
+thread tail = NULL; // back of the thread pool
+int ready = 0;      // threads in the pool
 
 void admit(thread new)
 {
     /* add a thread to the pool at the tail of the linked list */
+    new->sched_one = NULL;
+    new->sched_two = tail;
 
     // check if we have empty thread pool
     if (head == NULL)
@@ -39,15 +61,10 @@ void admit(thread new)
     }
     else
     {
-        // loop on qlen
-        thread curr_thread = head;
-        while (curr_thread->sched_one != NULL)
-        {
-            curr_thread = curr_thread->sched_one;
-        }
-        // set next to new thread
-        curr_thread->sched_one = new;
+        tail->sched_one = new;
     }
+    tail = new;
+    ready++;
 }
 void sched_remove(thread victim)
 {
@@ -55,58 +72,38 @@ void sched_remove(thread victim)
     thread unless we saved one before the call to this function */
 
     // check if we have empty thread pool
-    if (head != NULL)
+    if (head == NULL)
     {
-        // first check if the head is what we want to remove so that we don't seg fault
-        if (head->tid == victim->tid)
-        {
-            thread temp = head;
-            head = head->sched_one;
-            temp->sched_one = NULL;
-        }
-        else
-        {
-            // loop on qlen for tid
-            thread prev_thread = NULL;
-            thread curr_thread = head;
-            int found_flag = 0;
-            while (curr_thread->sched_one != NULL && !found_flag)
-            {
-                if (curr_thread->tid != victim->tid)
-                {
-                    prev_thread = curr_thread;
-                    curr_thread = curr_thread->sched_one;
-                }
-                else
-                {
-                    found_flag = 1;
-                }
-            }
-            if (curr_thread->tid == victim->tid) // need to check if the last one is the victim
-            {
-                found_flag = 1;
-            }
-            if (found_flag)
-            {
-                // get the next thread to link prev to next, either sets to the next thread or NULL
-                
-                thread next_thread = curr_thread->sched_one;
-                prev_thread->sched_one = next_thread;
-                curr_thread->sched_one = NULL;
-            }
-            else
-            {   
-                fprintf(stdout, "Victim: %d\n", victim->tid);
-                perror("Error finding thread to remove");
-                exit(EXIT_FAILURE);
-            }
-        }
+        perror("Empty queue, nothing to remove");
+        exit(EXIT_FAILURE);
     }
-    else
+    // only the head has no previous thread, anyone else without one isn't in the pool
+    if (victim != head && victim->sched_two == NULL)
     {
-        perror("Empty queue, nothing to remove");
+        fprintf(stdout, "Victim: %lu\n", victim->tid);
+        perror("Error finding thread to remove");
         exit(EXIT_FAILURE);
     }
+
+    if (victim->sched_two != NULL)
+    {
+        victim->sched_two->sched_one = victim->sched_one;
+    }
+    else
+    {
+        head = victim->sched_one;
+    }
+    if (victim->sched_one != NULL)
+    {
+        victim->sched_one->sched_two = victim->sched_two;
+    }
+    else
+    {
+        tail = victim->sched_two;
+    }
+    victim->sched_one = NULL;
+    victim->sched_two = NULL;
+    ready--;
 }
 
 thread next(void)
@@ -115,8 +112,11 @@ thread next(void)
     // put current thread at the end of the queue, should put NULL if no other processes in pool
     if (head != NULL) {
         thread next = head;
-        sched_remove(next);
-        admit(next); // put the thread at the end of the queue   
+        if (next != tail)
+        {
+            sched_remove(next);
+            admit(next); // put the thread at the end of the queue   
+        }
         return next; // could be NULL
     }
     return NULL;
@@ -125,13 +125,6 @@ thread next(void)
 int qlen(void)
 {
     /* number of ready threads       */
-    int ready = 0;
-    thread curr_thread = head;
-    while (curr_thread != NULL)
-    {
-        ready++;
-        curr_thread = curr_thread->sched_one;
-    }
     return ready;
 }
 
@@ -143,6 +136,268 @@ scheduler RoundRobin = &rr_publish;
 
 // START LWP FUNCTIONS
 
+static void registry_add(thread t)
+{
+    t->all_prev = NULL;
+    t->all_next = all_threads;
+    if (all_threads != NULL)
+    {
+        all_threads->all_prev = t;
+    }
+    all_threads = t;
+    statpage_create();
+}
+
+static void registry_remove(thread t)
+{
+    if (t->all_prev != NULL)
+    {
+        t->all_prev->all_next = t->all_next;
+    }
+    else
+    {
+        all_threads = t->all_next;
+    }
+    if (t->all_next != NULL)
+    {
+        t->all_next->all_prev = t->all_prev;
+    }
+}
+
+static void lwp_admit(thread t)
+{
+    /* hand a runnable thread to the scheduler, noting it for stats and tracing */
+    t->runstate = LWP_STATE_READY;
+    stats_admit(t);
+    statpage_admit(schedule);
+    TRACE(TRACE_ADMIT, t->tid, 0);
+    schedule->admit(t);
+}
+
+static thread lwp_next(void)
+{
+    /* ask the scheduler who runs next, logging the answer if recording */
+    thread t = schedule->next();
+    if (t != NULL)
+    {
+        replay_note(REPLAY_PICK, t->tid);
+    }
+    return t;
+}
+
+void lwp_wake(thread t, thread waker)
+{
+    /* put a blocked thread back on the scheduler */
+    TRACE(TRACE_WAKE, t->tid, waker->tid);
+    PROBE2(wake, t->tid, waker->tid);
+    replay_wake(t->tid);
+    t->blockedon = NULL;
+    t->unpark = NULL;
+    lwp_admit(t);
+}
+
+static void lwp_wake_waiter(thread waker)
+{
+    /* wake the thread that has been in lwp_wait() longest, if any */
+    thread waiting_thread = waiting;
+    if (waiting_thread != NULL)
+    {
+        waiting = waiting->lib_one;
+        waiting_thread->lib_one = NULL;
+        lwp_wake(waiting_thread, waker);
+    }
+}
+
+static void lwp_terminated_append(thread t)
+{
+    /* put an exited thread at the end of the terminated list (exited) for lwp_wait() */
+    t->exited = NULL;
+    if (terminated == NULL)
+    {
+        terminated = t;
+    }
+    else
+    {
+        terminated_tail->exited = t;
+    }
+    terminated_tail = t;
+}
+
+// scopes begun before lwp_start(), the original thread takes them over
+static lwp_scope *scope_open = NULL;
+
+static void scope_adopt(thread c)
+{
+    /* put a new thread in its creator's innermost open scope or, failing
+    that, in the scope the creator itself belongs to */
+    lwp_scope *s;
+
+    if (current == NULL)
+    {
+        s = scope_open;
+    }
+    else
+    {
+        s = current->scopes != NULL ? current->scopes : current->scope;
+    }
+    if (s == NULL)
+    {
+        return;
+    }
+    c->scope = s;
+    c->scope_prev = NULL;
+    c->scope_next = s->children;
+    if (s->children != NULL)
+    {
+        s->children->scope_prev = c;
+    }
+    s->children = c;
+    s->live++;
+}
+
+static void scope_unlink(thread t)
+{
+    /* take t off its scope's list of children */
+    if (t->scope_prev != NULL)
+    {
+        t->scope_prev->scope_next = t->scope_next;
+    }
+    else
+    {
+        t->scope->children = t->scope_next;
+    }
+    if (t->scope_next != NULL)
+    {
+        t->scope_next->scope_prev = t->scope_prev;
+    }
+    t->scope = NULL;
+}
+
+static void lwp_switch(thread from, thread to);
+
+// thread->cancel: asked to stop, then stopping (so the exit is marked canceled)
+#define CANCEL_REQUESTED 1
+#define CANCEL_UNWOUND   2
+static void lwp_cancel_unwind(thread t);
+
+// set while a stackless context's step runs, see lwp_stackless_create()
+static int stackless_stepping = 0;
+static void lwp_stackless_host(void);
+
+static void stackless_prime(thread c)
+{
+    /* a fresh first frame for c at the top of the stackless stack, same layout as lwp_create() */
+    unsigned long *stack_pointer = stack_top(c);
+    stack_pointer--;
+    *stack_pointer = (unsigned long)0;
+    stack_pointer--;
+    *stack_pointer = (unsigned long)lwp_stackless_host;
+    stack_pointer--;
+    c->state.rbp = (unsigned long)stack_pointer;
+    c->state.rsp = (unsigned long)stack_pointer;
+}
+
+static void unpark_wait(thread t, void *where)
+{
+    /* take t out of the lwp_wait() queue */
+    thread *link = &waiting;
+    while (*link != t)
+    {
+        link = &(*link)->lib_one;
+    }
+    *link = t->lib_one;
+    t->lib_one = NULL;
+}
+
+static void lwp_waiting_append(thread t)
+{
+    /* put t at the back of the lwp_wait() queue, linked through lib_one */
+    t->lib_one = NULL;
+    if (waiting == NULL)
+    {
+        waiting = t;
+    }
+    else
+    {
+        thread curr_thread = waiting;
+        while (curr_thread->lib_one != NULL)
+        {
+            curr_thread = curr_thread->lib_one;
+        }
+        // set next to new thread
+        curr_thread->lib_one = t;
+    }
+}
+
+static void lwp_switch_check(thread from)
+{
+    /* abort if from may not switch away the usual way. Called before anything
+    is changed, so the diagnostic is all that happens */
+    if (stackless_stepping)
+    {
+        fprintf(stderr, "lwp: tid %lu is stackless, its step can't block, yield or exit\n", from->tid);
+        abort();
+    }
+    if (from->generator)
+    {
+        // the scheduler doesn't know it, nothing would ever switch back
+        fprintf(stderr, "lwp: tid %lu is a generator, it can only lwp_gen_yield() or return\n", from->tid);
+        abort();
+    }
+}
+
+void lwp_block(thread t, const char *on, void (*unpark)(thread, void *), void *where)
+{
+    /* take the running thread off the scheduler and run someone else until it is woken.
+    Off the queue first so next() can't hand it back to itself. unpark(t, where) takes
+    it off whatever list it is parked on, so lwp_cancel() can wake it early. Every
+    block is a cancellation point */
+    lwp_switch_check(t);
+    if (t->cancel == CANCEL_REQUESTED)
+    {
+        // cancelled while it was ready: nothing would wake it once parked
+        unpark(t, where);
+        lwp_cancel_unwind(t);
+    }
+    TRACE(TRACE_BLOCK, t->tid, 0);
+    PROBE1(block, t->tid);
+    t->runstate = LWP_STATE_BLOCKED;
+    t->blockedon = on;
+    t->unpark = unpark;
+    t->parkedon = where;
+    schedule->remove(t);
+    lwp_switch(t, lwp_next());
+    if (t->cancel == CANCEL_REQUESTED)
+    {
+        lwp_cancel_unwind(t);
+    }
+}
+
+static tid_t lwp_reap(thread t, int *status)
+{
+    /* free an exited thread that is on no list any more */
+    tid_t tid = t->tid;
+    if (status != NULL)
+    {
+        *status = t->status;
+    }
+    PROBE2(reap, tid, t->status);
+    registry_remove(t);
+    local_free(t);
+    scratch_release(t); // after local_free(), whose destructors may still use it
+    if (t->scope != NULL)
+    {
+        scope_unlink(t);
+    }
+    if (t->step == NULL)
+    {
+        stack_free(t); // stackless contexts only borrow the stackless stack
+    }
+    free(t); // free the memory for the context
+    statpage_reap();
+    return tid;
+}
+
 static void lwp_wrap(lwpfun fun, void *arg)
 {
     /* call the given lwpfucntion with the given argument.
@@ -153,22 +408,39 @@ static void lwp_wrap(lwpfun fun, void *arg)
 }
 
 tid_t lwp_create(lwpfun function, void *argument)
+{
+    return lwp_create_attr(function, argument, NULL);
+}
+
+tid_t lwp_create_attr(lwpfun function, void *argument, const lwp_attr *attr)
+{
+    return lwp_create_inplace(function, argument, 0, NULL, attr);
+}
+
+tid_t lwp_create_inplace(lwpfun function, void *argument, size_t reserve, void **place, const lwp_attr *attr)
 {
     /*
     Creates a new thread and admits it to the current scheduler. The thread’s resources will consist of a
     context and stack, both initialized so that when the scheduler chooses this thread and its context is
     loaded via swap_rfiles() it will run the given function. This may be called by any thread.
+    attr may be NULL for the defaults, see lwp.h for the options.
+    With reserve > 0 that many zeroed bytes (rounded up to 16) at the top of the new stack are kept out
+    of its frames, *place is set to them and function gets them as its argument instead of argument.
+    Such a thread is joinable: lwp_wait() leaves it alone and lwp_join() reaps it (or lwp_detach()), so
+    the bytes stay valid after it exits. Not for LWP_ATTR_SHARED_STACK threads, returns NO_THREAD.
+    attr->scratch bytes at the bottom of the stack start its lwp_scratch_alloc() space, NO_THREAD too if
+    the stack is shared or can't spare them.
     */
-    long page_size;
-    struct rlimit rlp;
-    int result;
-    unsigned long resource_limit;
-    void *s;
     thread c;
     unsigned long *stack_pointer;
 
+    if (attr != NULL && (attr->flags & LWP_ATTR_SHARED_STACK) && (reserve > 0 || attr->scratch > 0))
+    {
+        return NO_THREAD; // a shared stack is someone else's between runs, nothing on it stays put
+    }
+
     // need to allocate memory for the context struct
-    c = malloc(sizeof(context));
+    c = calloc(1, sizeof(context));
     if (c == NULL)
     {
         perror("Error allocating memory for context struct");
@@ -181,55 +453,59 @@ tid_t lwp_create(lwpfun function, void *argument)
     c->exited = NULL;
     c->lib_one = NULL;
     c->lib_two = NULL;
+    c->fun = function;
 
-    // Determine how big the stack should be using sysconf(3)
-    page_size = sysconf(_SC_PAGE_SIZE);
-
-    // Get the value of the resource limit for the stack size (RLIMIT_STACK) using getrlimit(2). Use the soft limit
-    result = getrlimit(RLIMIT_STACK, &rlp);
+    // get a stack, c->stack is the low end and c->stacksize is in bytes
+    stack_alloc(c, attr);
 
-    // If RLIMIT_STACK does not exist or if its value is RLIM_INFINITY, use a stack size of 8MB.
-    if (result == -1 || rlp.rlim_cur == RLIM_INFINITY)
+    if (c->shared != NULL)
     {
-        resource_limit = 8 * 1024 * 1024;
+        // the first frame is built in the save area and copied in on the first switch
+        stack_pointer = copystack_prime(c, 3 * sizeof(unsigned long));
     }
     else
     {
-        resource_limit = rlp.rlim_cur;
-        // make sure the resouce limit is a multiple of the page size, otherwise round up to the nearest multiple of the page size
-        if (resource_limit % page_size != 0)
-        {
-            resource_limit = resource_limit + (page_size - (resource_limit % page_size));
-        }
+        // now our stack pointer is at high memory address
+        stack_pointer = stack_top(c);
     }
-
-    // Allocate a stack the size of our resource limit, MAP_STACK ensures stack is on 16-byte boundary
-    // stack pointer will be at a low memory address
-    stack_pointer = mmap(NULL, resource_limit, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_STACK, -1, 0);
-    if (stack_pointer == MAP_FAILED)
+    if (reserve > 0)
     {
-        perror("Error allocating memory for stack");
-        exit(EXIT_FAILURE);
+        size_t words = (reserve + 15) / 16 * 2;
+        if (words * sizeof(unsigned long) >= c->stacksize / 2)
+        {
+            fprintf(stderr, "lwp_create_inplace: %zu bytes won't fit on a %zu byte stack\n", reserve, c->stacksize);
+            stack_free(c);
+            free(c);
+            tid_counter--;
+            return NO_THREAD;
+        }
+        stack_pointer -= words;
+        memset(stack_pointer, 0, words * sizeof(unsigned long));
+        *place = stack_pointer;
+        argument = stack_pointer;
+        c->joinable = 1;
     }
-    if ((uintptr_t)stack_pointer % 16 != 0)
+    if (attr != NULL && attr->scratch > 0)
     {
-        perror("Stack not properly aligned");
-        exit(EXIT_FAILURE);
+        size_t low = (attr->scratch + 15) & ~(size_t)15;
+        if (low >= c->stacksize / 2)
+        {
+            fprintf(stderr, "lwp_create_inplace: a %zu byte scratch area won't fit on a %zu byte stack\n", attr->scratch, c->stacksize);
+            stack_free(c);
+            free(c);
+            tid_counter--;
+            return NO_THREAD;
+        }
+        scratch_stack(c, low);
     }
-    c->stack = stack_pointer; // Set base of the stack, need so that we can unmap later
-
-    // now our stack pointer is at high memory address, divide by size of unsigned long
-    stack_pointer = stack_pointer + (resource_limit / sizeof(unsigned long));
 
     // check that stack pointer is divisble by 16, move to lower addresses.
-    if ((uintptr_t)stack_pointer % 16 != 0)
+    if ((uintptr_t)stack_top(c) % 16 != 0)
     {
         perror("Stack not properly aligned - after moving to lower addresses");
         exit(EXIT_FAILURE);
     }
 
-    c->stacksize = resource_limit; // keep track of stack size in bytes
-
     // WE HAD TO DECREMENT LIKE THIS BECAUSE WE WERE GETTING A SEG FAULT
     stack_pointer--;
     *stack_pointer = (unsigned long)0;
@@ -238,6 +514,12 @@ tid_t lwp_create(lwpfun function, void *argument)
     stack_pointer--;                          // this will subtract the size of an unsiged long from the stack pointer
     // need to move the address two times so that we say alligned on 16 byte boundary
 
+    if (c->shared != NULL)
+    {
+        // registers have to point at where the frame will be on the shared stack
+        stack_pointer = stack_top(c) - 3;
+    }
+
     // need to set all the registers for the new lwp using the function arguments from above
     c->state.rdi = (unsigned long)function;
     c->state.rsi = (unsigned long)argument;
@@ -251,10 +533,101 @@ tid_t lwp_create(lwpfun function, void *argument)
     {
         schedule = RoundRobin;
     }
-    schedule->admit(c);
+    TRACE(TRACE_CREATE, c->tid, current_running_thread_tid);
+    PROBE2(create, c->tid, current_running_thread_tid);
+    if (!c->joinable)
+    {
+        scope_adopt(c); // a joinable one is already spoken for
+    }
+    registry_add(c);
+    lwp_admit(c);
     return c->tid;
 }
 
+static void lwp_retire(thread removed_thread, int status)
+{
+    /* everything lwp_exit() does short of switching away: mark it terminated, take it off
+    the scheduler and hand it to whoever will reap it */
+    removed_thread->status = MKTERMSTAT(removed_thread->cancel == CANCEL_UNWOUND ? LWP_TERM | LWP_CANCELED : LWP_TERM, status);
+    removed_thread->cancel = 0; // the lwp_yield() on the way out is no cancellation point
+    removed_thread->runstate = LWP_STATE_TERMINATED;
+    statpage_exit();
+    if (removed_thread->step == NULL)
+    {
+        stack_watermark(removed_thread); // no-op unless lwp_stack_watermarks() is on
+    }
+    TRACE(TRACE_EXIT, removed_thread->tid, status);
+    PROBE2(exit, removed_thread->tid, status);
+    schedule->remove(removed_thread);
+
+    if (removed_thread->scope != NULL)
+    {
+        lwp_scope *scope = removed_thread->scope;
+        if ((status & 0xff) != 0 || LWPCANCELED(removed_thread->status))
+        {
+            scope->failed++;
+        }
+        if (--scope->live == 0 && scope->waiter != NULL)
+        {
+            lwp_wake(scope->waiter, removed_thread);
+            scope->waiter = NULL;
+        }
+    }
+    if (removed_thread->joiner != NULL)
+    {
+        // lwp_join() is waiting for exactly this one, it does the reaping
+        lwp_wake(removed_thread->joiner, removed_thread);
+        removed_thread->joiner = NULL;
+    }
+    else if (!removed_thread->joinable && removed_thread->scope == NULL)
+    {
+        // put it on the terminated list and readmit the oldest waiting thread so it can clean up
+        lwp_terminated_append(removed_thread);
+        lwp_wake_waiter(removed_thread);
+    }
+    else if (schedule->qlen() == 0)
+    {
+        // joinable and scoped threads stay off the terminated list, but a waiter has to hear that nothing is left
+        lwp_wake_waiter(removed_thread);
+    }
+}
+
+static void lwp_switch_note(thread from, thread to)
+{
+    /* the bookkeeping half of a switch: from stops running, to starts */
+    stats_switch(from, to);
+    statpage_switch(schedule);
+    TRACE(TRACE_SWITCH, from->tid, to->tid);
+    PROBE2(switch, from->tid, to->tid);
+    current_running_thread_tid = to->tid;
+    current = to;
+    if (from->runstate == LWP_STATE_RUNNING)
+    {
+        from->runstate = LWP_STATE_READY;
+    }
+    to->runstate = LWP_STATE_RUNNING;
+}
+
+static void lwp_switch(thread from, thread to)
+{
+    /* every context switch in the library goes through here */
+    lwp_switch_check(from);
+    lwp_switch_note(from, to);
+
+    // stackless contexts always start over on the stackless stack, see lwp_stackless_host()
+    if (to->step != NULL)
+    {
+        stackless_prime(to);
+    }
+    // copy-stack threads may need their frames put back on the shared stack first
+    if (to->shared != NULL && to->shared->owner != to)
+    {
+        copystack_switch(from, to);
+        return;
+    }
+    swap_rfiles(&from->state, &to->state);
+}
+
 void lwp_yield(void)
 { 
     //     Yields control to the next thread as indicated by the scheduler. If there is no next thread, calls exit(3)
@@ -262,19 +635,21 @@ void lwp_yield(void)
 
     thread next_thread, current_thread;
 
-    
-    current_thread = tid2thread(lwp_gettid()); 
-    next_thread = schedule->next();
+    current_thread = current;
+    lwp_switch_check(current_thread);
+    if (current_thread->cancel == CANCEL_REQUESTED)
+    {
+        lwp_cancel_unwind(current_thread); // a cancellation point
+    }
+    next_thread = lwp_next();
 
     // check if next thread is null meaning we have no scheduled threads
     if(next_thread == NULL) {
         lwp_exit(3);
     }
 
-    current_running_thread_tid = next_thread->tid;
-
     // swap the context of the current thread with the next thread
-    swap_rfiles(&current_thread->state, &next_thread->state);
+    lwp_switch(current_thread, next_thread);
     
 }
 
@@ -291,42 +666,16 @@ void lwp_exit(int status)
     // yeild at the end of this function
 
     thread removed_thread;
-    removed_thread = tid2thread(lwp_gettid()); 
-    removed_thread->status = status;
-    schedule->remove(removed_thread);
-
-    // put this thread at the end of the terminated list (exited)  // need to address the waiting threads before putting calling thread on terminated
-    if (terminated == NULL)
-    {   
-        terminated = removed_thread;
-    }
-    else
-    {
-        thread curr_thread = terminated;
-        while (curr_thread->exited != NULL)
-        {
-            curr_thread = curr_thread->exited;
-        }
-        // set next to new thread
-        curr_thread->exited = removed_thread;
-    }
-    // check waiting list, readmit waiting threads so they can continue to clean up calling thread
-    if (waiting != NULL) // if there are waiting threads, put the oldest one back into the scheduler
-    {
-        // get the thread at the front of the list
-        thread waiting_thread = waiting;
-        // remove the thread from the list
-        waiting = waiting->lib_one;
-        waiting_thread->lib_one = NULL;
-        // admit the thread back into the scheduler
-        schedule->admit(waiting_thread);
-    }
-    if (qlen() > 0)
+    removed_thread = current; 
+    lwp_switch_check(removed_thread);
+    local_exit(removed_thread);
+    lwp_retire(removed_thread, status);
+    if (schedule->qlen() > 0)
     {
             lwp_yield();
     }
     thread main_calling_thread = tid2thread(1);
-    swap_rfiles(&removed_thread->state, &main_calling_thread->state);
+    lwp_switch(removed_thread, main_calling_thread);
 }
 
 tid_t lwp_wait(int *status) // removing too many times somewhere before exitting, 
@@ -335,180 +684,647 @@ tid_t lwp_wait(int *status) // removing too many times somewhere before exitting
     runnable threads, blocks until one terminates. If status is non-NULL, *status is populated with its
     termination status. Returns the tid of the terminated thread or NO_THREAD if it would block forever
     because there are no more runnable threads that could terminate.*/
-    thread calling_thread = tid2thread(lwp_gettid()); // USE GLOBAL NOW
-    if (terminated == NULL) // no terminated threads, so we have to block
+    thread calling_thread = current;
+    while (terminated == NULL) // no terminated threads, so we have to block
     {
         if (schedule->qlen() <= 1)        // no more runnable threads, so we would block forever
         {
             return NO_THREAD;
         }
         // add the current thread to the waiting list
-        if (waiting == NULL)
-        {
-            waiting = calling_thread;
-        }
-        else // put at the back of the waiting queue
-        {
-            thread curr_thread = waiting;
-            while (curr_thread->lib_one != NULL)
-            {
-                curr_thread = curr_thread->lib_one;
-            }
-            // set next to new thread
-            curr_thread->lib_one = calling_thread;
-        }
-        // Yield to the next process
-        thread next_thread = schedule->next();
-        current_running_thread_tid = next_thread->tid;
-
-        schedule->remove(calling_thread);
-        swap_rfiles(&calling_thread->state, &next_thread->state);
+        lwp_waiting_append(calling_thread);
+        // Yield to the next process, woken when something exits (which may be a joinable thread, so check again)
+        lwp_block(calling_thread, "lwp_wait", unpark_wait, NULL);
     }
 
     // if we get here, we have a terminated thread, so we can clean up the memory
     thread terminated_thread = terminated; // get the thread at the front of the list
-    // set the status of the thread, check if NULL
-    if(status != NULL) {
-        *status = MKTERMSTAT(LWP_TERM, terminated_thread->status);
-    }
     terminated = terminated->exited;  // remove the thread from the list
-    // free the memory for the stack
-
-    munmap(terminated_thread->stack, terminated_thread->stacksize);
-    free(terminated_thread); // free the memory for the context
-    return terminated_thread->tid;
-}
-
-tid_t lwp_gettid(void) // problem could be here
-{
-    // check if we have empty thread pool
-    if (schedule->qlen() == 0)
+    if (terminated == NULL)
     {
-        perror("No running threads, can't get tid of current thread");
-        return NO_THREAD;
-
+        terminated_tail = NULL;
     }
-    return current_running_thread_tid;
+    return lwp_reap(terminated_thread, status);
 }
 
-void lwp_start(void)
+static thread lwp_claim(tid_t tid)
 {
-    /*Starts the threading system by converting the calling thread—the original system thread—into a LWP
-    by allocating a context for it and admitting it to the scheduler, and yields control to whichever thread the
-    scheduler indicates. It is not necessary to allocate a stack for this thread since it already has one.  */
+    /* make tid joinable so only lwp_join() reaps it. NULL if there is no such
+    thread, it is the caller, or someone is already waiting on it */
+    thread t = tid2thread(tid);
 
-    // allocate a context for the calling thread
-    thread calling_thread;
-    thread first_lwp;
-    calling_thread = malloc(sizeof(context));
-    if (calling_thread == NULL)
+    if (t == NULL || t == current || t->joiner != NULL)
     {
-        perror("Error allocating memory for context struct- calling thread");
-        exit(EXIT_FAILURE);
+        return NULL;
     }
-    calling_thread->tid = 1;
-    calling_thread->status = LWP_LIVE; // thread is now live
-
-    // admit the context to the scheduler
-    schedule->admit(calling_thread);
-
-    //  VERY LAST THING we do in this function is switch the stack to the first lwp, then when we return.
-    //  We will return to lwp_wrap. To do this switch I will get the next thread from the scheduler.
-    //  Then I will use swap_rfiles to switch the stack to this thread. All the info about threads will
-    //  be stored in the scheduler, allowing this process to work.
-    first_lwp = schedule->next(); 
-    current_running_thread_tid = first_lwp->tid; 
-    swap_rfiles(&calling_thread->state, &first_lwp->state);
-   
+    if (!t->joinable && t->scope == NULL && LWPTERMINATED(t->status))
+    {
+        // already on the terminated list, take it off so lwp_wait() can't have it
+        thread *link = &terminated;
+        thread prev = NULL;
+        while (*link != t)
+        {
+            prev = *link;
+            link = &(*link)->exited;
+        }
+        *link = t->exited;
+        if (terminated_tail == t)
+        {
+            terminated_tail = prev;
+        }
+        t->exited = NULL;
+    }
+    t->joinable = 1;
+    return t;
 }
 
+static void unpark_join(thread t, void *where)
+{
+    /* t was waiting for where to exit */
+    ((thread)where)->joiner = NULL;
+}
 
-thread tid2thread(tid_t tid)
+int lwp_await(tid_t tid)
 {
-    // check if we have empty thread pool
-    if (head != NULL)
+    /* block until tid has exited, without reaping it. From then on only
+    lwp_join() reaps it. Returns 0, or -1 if there is no such thread, someone
+    else is already waiting on it, or it could never exit (nothing else can
+    run, or the caller isn't an LWP yet). Failing leaves tid as it was */
+    thread t = tid2thread(tid);
+    int was_joinable;
+
+    if (t == NULL)
     {
-        if (head->tid == tid)
-        {
-            return head;
-        }
-        // loop on qlen for tid
-        thread curr_thread = head;
-        int found_flag = 0;
-        while (curr_thread->sched_one != NULL && !found_flag)
+        return -1;
+    }
+    was_joinable = t->joinable;
+    if (lwp_claim(tid) == NULL)
+    {
+        return -1;
+    }
+    while (!LWPTERMINATED(t->status))
+    {
+        if (current == NULL || schedule->qlen() <= 1)
         {
-            if (curr_thread->tid == tid)
+            if (!was_joinable)
             {
-                found_flag = 1;
-            }
-            else
-            {
-                curr_thread = curr_thread->sched_one;
+                lwp_detach(tid); // undo the claim, lwp_wait() may still reap it
             }
+            return -1;
         }
-        if (curr_thread->tid == tid) // need to check if the last one is the victim
+        t->joiner = current;
+        lwp_block(current, "lwp_join", unpark_join, t);
+        t->joiner = NULL;
+    }
+    return 0;
+}
+
+tid_t lwp_join(tid_t tid, int *status)
+{
+    /* wait for tid in particular to exit and reap it, like lwp_wait() but
+    for one thread. Returns tid, or NO_THREAD when lwp_await() fails */
+    if (lwp_await(tid) < 0)
+    {
+        return NO_THREAD;
+    }
+    return lwp_reap(tid2thread(tid), status);
+}
+
+tid_t lwp_try_wait(int *status)
+{
+    /* lwp_wait() that never blocks: reap the oldest terminated thread, or
+    return NO_THREAD if there isn't one yet */
+    if (terminated == NULL)
+    {
+        return NO_THREAD;
+    }
+    return lwp_wait(status);
+}
+
+void lwp_detach(tid_t tid)
+{
+    /* nobody will join tid after all, lwp_wait() may reap it again */
+    thread t = tid2thread(tid);
+
+    if (t == NULL || !t->joinable || t->joiner != NULL)
+    {
+        return;
+    }
+    t->joinable = 0;
+    if (LWPTERMINATED(t->status) && t->scope == NULL)
+    {
+        lwp_terminated_append(t);
+        lwp_wake_waiter(current);
+    }
+}
+
+// STACKLESS CONTEXTS
+// A stackless context is a step function called over and over until it says
+// it is done. Steps run on one shared stack that holds nothing between calls,
+// so a context costs its struct and nothing else (C++20 coroutines keep their
+// state in the coroutine frame, see lwp_co.hpp).
+
+tid_t lwp_stackless_create(lwpstep step, void *arg)
+{
+    /* admit a stackless context that calls step(arg) each time it is scheduled.
+    step returns LWP_STEP_AGAIN to be called again later, or an exit status
+    (0-255) once it is finished. It must not call anything that blocks, yields
+    or exits: it parks with lwp_park_join()/lwp_park_wait() and returns instead */
+    thread c;
+    size_t size;
+
+    c = calloc(1, sizeof(context));
+    if (c == NULL)
+    {
+        perror("Error allocating memory for context struct");
+        exit(EXIT_FAILURE);
+    }
+    c->tid = tid_counter++;
+    c->status = LWP_LIVE;
+    c->fun = step; // for the profiler and lwp_dump()
+    c->step = step;
+    c->steparg = arg;
+    c->stack = stack_stackless(&size);
+    c->stacksize = size;
+    c->state.fxsave = FPU_INIT;
+    if (schedule == NULL)
+    {
+        schedule = RoundRobin;
+    }
+    TRACE(TRACE_CREATE, c->tid, current_running_thread_tid);
+    PROBE2(create, c->tid, current_running_thread_tid);
+    scope_adopt(c);
+    registry_add(c);
+    lwp_admit(c);
+    return c->tid;
+}
+
+static void lwp_stackless_host(void)
+{
+    /* the first frame on the stackless stack whenever some thread switches to a
+    stackless context. Runs steps for as long as the scheduler keeps picking
+    stackless contexts, and is simply abandoned when it picks a stackful one */
+    thread c = current;
+    thread next_thread;
+    int result;
+
+    for (;;)
+    {
+        stackless_stepping = 1;
+        result = c->step(c->steparg);
+        stackless_stepping = 0;
+
+        if (result != LWP_STEP_AGAIN)
         {
-            found_flag = 1;
+            local_exit(c);
+            lwp_retire(c, result);
+            next_thread = schedule->qlen() > 0 ? lwp_next() : tid2thread(1);
         }
-        if (found_flag)
+        else if (c->runstate == LWP_STATE_BLOCKED)
         {
-            return curr_thread;
+            // the step parked, lwp_block() without the switch
+            TRACE(TRACE_BLOCK, c->tid, 0);
+            PROBE1(block, c->tid);
+            schedule->remove(c);
+            next_thread = lwp_next();
         }
-    }
-    if (terminated != NULL)
-    {
-        if (terminated->tid == tid)
+        else
         {
-            return terminated;
+            next_thread = lwp_next();
         }
-        // loop on qlen for tid
-        thread curr_thread = terminated;
-        int found_flag = 0;
-        while (curr_thread->exited != NULL && !found_flag)
+        if (next_thread == NULL)
         {
-            if (curr_thread->tid == tid)
-            {
-                found_flag = 1;
-            }
-            else
-            {
-                curr_thread = curr_thread->exited;
-            }
+            exit(3); // nothing can ever run again, as in lwp_yield()
         }
-        if (curr_thread->tid == tid) // need to check if the last one is the victim
+        if (next_thread->step == NULL)
         {
-            found_flag = 1;
+            lwp_switch(c, next_thread); // never comes back to this frame
         }
-        if (found_flag)
+        // another stackless one, no need to touch any registers
+        lwp_switch_note(c, next_thread);
+        c = next_thread;
+    }
+}
+
+static thread lwp_park(const char *on)
+{
+    /* mark the stackless context whose step is running as blocked, its host
+    takes it off the scheduler once the step returns. NULL outside a step */
+    if (!stackless_stepping)
+    {
+        return NULL;
+    }
+    current->runstate = LWP_STATE_BLOCKED;
+    current->blockedon = on;
+    return current;
+}
+
+int lwp_park_join(tid_t tid)
+{
+    /* from a step: wake this context once tid exits, then lwp_join() reaps it
+    without blocking. Returns 0 if parked, 1 if tid has exited already, -1 if
+    tid can't be joined or this isn't a step */
+    thread t;
+
+    if (!stackless_stepping || (t = lwp_claim(tid)) == NULL)
+    {
+        return -1;
+    }
+    if (LWPTERMINATED(t->status))
+    {
+        return 1;
+    }
+    t->joiner = lwp_park("lwp_join");
+    return 0;
+}
+
+int lwp_park_wait(void)
+{
+    /* from a step: wake this context when some thread exits, then
+    lwp_try_wait() reaps it. Returns 0 if parked, 1 if one is ready to reap
+    now, -1 if nothing else could ever exit or this isn't a step */
+    if (!stackless_stepping)
+    {
+        return -1;
+    }
+    if (terminated != NULL)
+    {
+        return 1;
+    }
+    if (schedule->qlen() <= 1)
+    {
+        return -1;
+    }
+    lwp_waiting_append(lwp_park("lwp_wait"));
+    return 0;
+}
+
+// GENERATORS
+// A generator is a thread the scheduler never sees. lwp_gen_next() switches
+// straight to it and lwp_gen_yield() straight back, and the value rides in rax
+// through swap_rfiles_value(), so a hand-off is one register swap each way and
+// no other thread gets to run in between.
+
+static void *gen_transfer(thread from, thread to, void *value)
+{
+    /* switch from one side of a generator to the other, the caller has set from->runstate */
+    stats_admit(to); // handed the CPU directly, it never sat in a run queue
+    lwp_switch_note(from, to);
+    to->blockedon = NULL;
+    return swap_rfiles_value(&from->state, &to->state, value);
+}
+
+static void lwp_gen_wrap(lwpfun fun, void *arg)
+{
+    /* the first frame of a generator: run it, then go back to the consumer for good */
+    thread self = current;
+    int rval;
+    rval = fun(arg);
+    local_exit(self);
+    self->status = MKTERMSTAT(LWP_TERM, rval);
+    self->runstate = LWP_STATE_TERMINATED;
+    stack_watermark(self);
+    gen_transfer(self, self->consumer, NULL);
+}
+
+static void gen_free(thread gen)
+{
+    /* reap a generator that won't run again */
+    if (gen->runstate != LWP_STATE_TERMINATED)
+    {
+        gen->status = MKTERMSTAT(LWP_TERM, 0);
+        gen->runstate = LWP_STATE_TERMINATED;
+    }
+    statpage_exit();
+    TRACE(TRACE_EXIT, gen->tid, LWPTERMSTAT(gen->status));
+    PROBE2(exit, gen->tid, LWPTERMSTAT(gen->status));
+    lwp_reap(gen, NULL);
+}
+
+thread lwp_gen_create(lwpfun function, void *argument, const lwp_attr *attr)
+{
+    /* a generator that runs function(argument) on its own stack, starting at
+    the first lwp_gen_next(). Each lwp_gen_yield() hands a value back; when
+    function returns the generator is finished and its return value dropped.
+    NULL for LWP_ATTR_SHARED_STACK, whose frames would be copied out from under it */
+    thread c;
+    unsigned long *stack_pointer;
+
+    if (attr != NULL && (attr->flags & LWP_ATTR_SHARED_STACK))
+    {
+        return NULL;
+    }
+    c = calloc(1, sizeof(context));
+    if (c == NULL)
+    {
+        perror("Error allocating memory for context struct");
+        exit(EXIT_FAILURE);
+    }
+    c->tid = tid_counter++;
+    c->status = LWP_LIVE;
+    c->fun = function;
+    c->generator = 1;
+    stack_alloc(c, attr);
+
+    // same first frame as lwp_create(), with lwp_gen_wrap() in place of lwp_wrap()
+    stack_pointer = stack_top(c);
+    stack_pointer--;
+    *stack_pointer = (unsigned long)0;
+    stack_pointer--;
+    *stack_pointer = (unsigned long)lwp_gen_wrap;
+    stack_pointer--;
+    c->state.rdi = (unsigned long)function;
+    c->state.rsi = (unsigned long)argument;
+    c->state.rbp = (unsigned long)stack_pointer;
+    c->state.rsp = (unsigned long)stack_pointer;
+    c->state.fxsave = FPU_INIT;
+    c->runstate = LWP_STATE_BLOCKED;
+    c->blockedon = "lwp_gen_yield";
+
+    TRACE(TRACE_CREATE, c->tid, current_running_thread_tid);
+    PROBE2(create, c->tid, current_running_thread_tid);
+    registry_add(c);
+    return c;
+}
+
+int lwp_gen_next(thread gen, void **value)
+{
+    /* run gen until it yields or returns. Returns 1 with the yielded value in
+    *value (if not NULL), 0 once gen has returned, after which it is freed and
+    gen is no longer valid, or -1 if gen isn't a suspended generator or there
+    is no LWP to come back to (before lwp_start()) */
+    thread self = current;
+    void *v;
+
+    if (self == NULL || gen == NULL || !gen->generator || gen->consumer != NULL)
+    {
+        return -1;
+    }
+    gen->consumer = self;
+    self->runstate = LWP_STATE_BLOCKED;
+    self->blockedon = "lwp_gen_next";
+    v = gen_transfer(self, gen, NULL);
+
+    // back from lwp_gen_yield() or lwp_gen_wrap()
+    gen->consumer = NULL;
+    if (gen->runstate == LWP_STATE_TERMINATED)
+    {
+        gen_free(gen);
+        return 0;
+    }
+    if (value != NULL)
+    {
+        *value = v;
+    }
+    return 1;
+}
+
+void lwp_gen_yield(void *value)
+{
+    /* from a generator: hand value to the lwp_gen_next() that ran it and
+    wait for the next call */
+    thread self = current;
+
+    if (!self->generator || self->consumer == NULL)
+    {
+        fprintf(stderr, "lwp: tid %lu isn't a generator, it can't lwp_gen_yield()\n", self->tid);
+        abort();
+    }
+    self->runstate = LWP_STATE_BLOCKED;
+    self->blockedon = "lwp_gen_yield";
+    gen_transfer(self, self->consumer, value);
+}
+
+int lwp_gen_destroy(thread gen)
+{
+    /* free a generator that hasn't finished, abandoning whatever its frames
+    hold. Returns 0, or -1 if gen isn't a suspended generator */
+    if (gen == NULL || !gen->generator || gen->consumer != NULL)
+    {
+        return -1;
+    }
+    gen_free(gen);
+    return 0;
+}
+
+// SCOPES
+
+void lwp_scope_begin(lwp_scope *s)
+{
+    /* open s as the caller's innermost scope, see lwp.h */
+    memset(s, 0, sizeof(*s));
+    s->owner = current;
+    if (current == NULL)
+    {
+        s->parent = scope_open;
+        scope_open = s;
+    }
+    else
+    {
+        s->parent = current->scopes;
+        current->scopes = s;
+    }
+}
+
+static void unpark_scope(thread t, void *where)
+{
+    ((lwp_scope *)where)->waiter = NULL;
+}
+
+long lwp_scope_end(lwp_scope *s)
+{
+    /* wait for every thread in s to exit, then free them all and close s.
+    Threads someone is lwp_join()ing are left to them. Returns how many
+    exited with a non-zero status, or -1 if s isn't the caller's innermost
+    scope or its threads can never all exit (s stays open) */
+    lwp_scope **open = current != NULL ? &current->scopes : &scope_open;
+    thread t;
+
+    if (*open != s)
+    {
+        return -1;
+    }
+    while (s->live > 0)
+    {
+        if (current == NULL || schedule->qlen() <= 1)
         {
-            return curr_thread;
+            return -1;
         }
+        s->waiter = current;
+        lwp_block(current, "lwp_scope", unpark_scope, s);
     }
-    if (waiting != NULL)
+    *open = s->parent;
+
+    // everything left has exited, and only s knows about them
+    while ((t = s->children) != NULL)
     {
-        if (waiting->tid == tid)
+        if (t->joinable)
         {
-            return waiting;
+            scope_unlink(t);
+            continue;
         }
-        // loop on qlen for tid
-        thread curr_thread = waiting;
-        int found_flag = 0;
-        while (curr_thread->lib_one != NULL && !found_flag)
+        lwp_reap(t, NULL);
+    }
+    return s->failed;
+}
+
+// CANCELLATION
+
+static void lwp_cancel_thread(thread t)
+{
+    /* ask t to stop, and wake it if it is parked somewhere that can be undone */
+    if (t->cancel != 0)
+    {
+        return; // asked already
+    }
+    t->cancel = CANCEL_REQUESTED;
+    if (t->runstate == LWP_STATE_BLOCKED && t->unpark != NULL)
+    {
+        t->unpark(t, t->parkedon);
+        lwp_wake(t, current != NULL ? current : t);
+    }
+}
+
+static void lwp_cancel_unwind(thread t)
+{
+    /* t has reached a cancellation point: clean up and exit, never returns */
+    lwp_cleanup *c;
+    thread child;
+
+    t->cancel = CANCEL_UNWOUND;
+    while ((c = t->cleanup) != NULL)
+    {
+        t->cleanup = c->prev;
+        c->fn(c->arg);
+    }
+    // nothing it started may outlive it, same as if it had ended its scopes itself
+    while (t->scopes != NULL)
+    {
+        for (child = t->scopes->children; child != NULL; child = child->scope_next)
         {
-            if (curr_thread->tid == tid)
-            {
-                found_flag = 1;
-            }
-            else
+            if (child->step == NULL && !child->generator && !LWPTERMINATED(child->status))
             {
-                curr_thread = curr_thread->lib_one;
+                lwp_cancel_thread(child);
             }
         }
-        if (curr_thread->tid == tid) // need to check if the last one is the victim
+        if (lwp_scope_end(t->scopes) < 0)
         {
-            found_flag = 1;
+            break;
         }
-        if (found_flag)
+    }
+    lwp_exit(0);
+}
+
+int lwp_cancel(tid_t tid)
+{
+    /* ask tid to stop at its next cancellation point, see lwp.h. Returns 0, or
+    -1 if there is no such live thread or it can't be cancelled (stackless
+    contexts and generators have no stack of their own to unwind) */
+    thread t = tid2thread(tid);
+
+    if (t == NULL || LWPTERMINATED(t->status) || t->step != NULL || t->generator)
+    {
+        return -1;
+    }
+    lwp_cancel_thread(t);
+    return 0;
+}
+
+void lwp_testcancel(void)
+{
+    /* a cancellation point that does nothing else */
+    if (current != NULL && current->cancel == CANCEL_REQUESTED)
+    {
+        lwp_cancel_unwind(current);
+    }
+}
+
+void lwp_cleanup_push(lwp_cleanup *c, void (*fn)(void *), void *arg)
+{
+    /* run fn(arg) if the caller is cancelled before the matching pop. c
+    belongs to the caller, usually a local in the same function */
+    c->fn = fn;
+    c->arg = arg;
+    c->prev = current->cleanup;
+    current->cleanup = c;
+}
+
+void lwp_cleanup_pop(int execute)
+{
+    /* drop the newest handler, running it first if execute */
+    lwp_cleanup *c = current->cleanup;
+
+    if (c == NULL)
+    {
+        return;
+    }
+    current->cleanup = c->prev;
+    if (execute)
+    {
+        c->fn(c->arg);
+    }
+}
+
+tid_t lwp_gettid(void) // problem could be here
+{
+    // check if we have empty thread pool
+    if (schedule->qlen() == 0)
+    {
+        perror("No running threads, can't get tid of current thread");
+        return NO_THREAD;
+
+    }
+    return current_running_thread_tid;
+}
+
+void lwp_start(void)
+{
+    /*Starts the threading system by converting the calling thread—the original system thread—into a LWP
+    by allocating a context for it and admitting it to the scheduler, and yields control to whichever thread the
+    scheduler indicates. It is not necessary to allocate a stack for this thread since it already has one.  */
+
+    // allocate a context for the calling thread
+    thread calling_thread;
+    thread first_lwp;
+    stats_start();
+    calling_thread = calloc(1, sizeof(context));
+    if (calling_thread == NULL)
+    {
+        perror("Error allocating memory for context struct- calling thread");
+        exit(EXIT_FAILURE);
+    }
+    calling_thread->tid = 1;
+    calling_thread->status = LWP_LIVE; // thread is now live
+    calling_thread->scopes = scope_open;
+    scope_open = NULL;
+    local_adopt(calling_thread);
+
+    // admit the context to the scheduler, lwp_create() may not have picked one yet
+    if (schedule == NULL)
+    {
+        schedule = RoundRobin;
+    }
+    registry_add(calling_thread);
+    lwp_admit(calling_thread);
+
+    //  VERY LAST THING we do in this function is switch the stack to the first lwp, then when we return.
+    //  We will return to lwp_wrap. To do this switch I will get the next thread from the scheduler.
+    //  Then I will use swap_rfiles to switch the stack to this thread. All the info about threads will
+    //  be stored in the scheduler, allowing this process to work.
+    current = calling_thread;
+    first_lwp = lwp_next();
+    lwp_switch(calling_thread, first_lwp);
+   
+}
+
+
+thread tid2thread(tid_t tid)
+{
+    // every thread is on the registry whatever its state or scheduler
+    thread curr_thread;
+    for (curr_thread = all_threads; curr_thread != NULL; curr_thread = curr_thread->all_next)
+    {
+        if (curr_thread->tid == tid)
         {
             return curr_thread;
         }
@@ -519,18 +1335,56 @@ thread tid2thread(tid_t tid)
 void lwp_set_scheduler(scheduler fun)
 {
     // if fun is null initialize round robin
-    if (fun != NULL)
+    if (fun == NULL)
+    {
+        fun = RoundRobin;
+    }
+    if (fun == schedule)
+    {
+        return;
+    }
+    if (fun->init != NULL)
     {
-        schedule = fun;
         fun->init();
     }
-    else
+    // hand every ready thread over to the new scheduler, in the old one's next() order
+    if (schedule != NULL)
     {
-        schedule = RoundRobin;
+        while (schedule->qlen() > 0)
+        {
+            thread moving = schedule->next();
+            schedule->remove(moving);
+            fun->admit(moving);
+        }
+        if (schedule->shutdown != NULL)
+        {
+            schedule->shutdown();
+        }
     }
+    schedule = fun;
 }
 
 scheduler lwp_get_scheduler(void)
 {
     return schedule;
+}
+
+size_t lwp_footprint(tid_t tid)
+{
+    /* bytes held by a parked thread: its context plus the saved frames for a
+    copy-stack thread, or its whole stack mapping otherwise */
+    thread t = tid2thread(tid);
+    if (t == NULL)
+    {
+        return 0;
+    }
+    if (t->shared != NULL)
+    {
+        return sizeof(context) + t->savecap;
+    }
+    if (t->step != NULL || t->stack == NULL)
+    {
+        return sizeof(context);
+    }
+    return sizeof(context) + t->stacksize;
 }
\ No newline at end of file
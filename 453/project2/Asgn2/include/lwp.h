@@ -1,6 +1,11 @@
 #ifndef LWPH
 #define LWPH
 #include <sys/types.h>
+#include <stdio.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
 
 #ifndef TRUE
 #define TRUE 1
@@ -39,6 +44,12 @@ registers {
 typedef unsigned long tid_t;
 #define NO_THREAD 0             /* an always invalid thread id */
 
+/* LWP-local storage: the first LWP_LOCAL_INLINE keys live in the context,
+ * the rest in a table allocated the first time one of them is set. */
+#define LWP_KEYS_MAX          256
+#define LWP_LOCAL_INLINE      8
+typedef unsigned int lwp_key_t;
+
 typedef struct threadinfo_st *thread;
 typedef struct threadinfo_st {
   tid_t         tid;            /* lightweight process id  */
@@ -51,15 +62,252 @@ typedef struct threadinfo_st {
   thread        sched_one;      /* Two more for            */
   thread        sched_two;      /* schedulers to use       */
   thread        exited;         /* and one for lwp_wait()  */
+  struct shared_stack *shared;  /* copy-stack mode: stack we run on */
+  void          *save;          /* copy-stack mode: saved frames    */
+  size_t        savelen;        /* live bytes held in save          */
+  size_t        savecap;        /* bytes allocated for save         */
+  int           (*fun)(void *); /* entry point given to lwp_create  */
+  size_t        stackpeak;      /* deepest stack use seen, bytes    */
+  int           watermark;      /* LWP_WATERMARK_* it was set up for */
+  unsigned long long stamp;     /* stats: tsc at last switch/admit  */
+  unsigned long long oncpu;     /* stats: tsc ticks spent running   */
+  unsigned long long readywait; /* stats: tsc ticks ready, not run  */
+  unsigned long switches;       /* stats: times switched in         */
+  int           runstate;       /* LWP_STATE_*                      */
+  thread        all_next;       /* every thread not yet reaped,     */
+  thread        all_prev;       /* for tid2thread() and lwp_dump()  */
+  int           joinable;       /* lwp_join() reaps it, not lwp_wait() */
+  thread        joiner;         /* blocked in lwp_join() on this one */
+  const char    *blockedon;     /* what a blocked thread waits in   */
+  int           (*step)(void *);/* stackless: called each time run  */
+  void          *steparg;
+  int           generator;      /* made by lwp_gen_create()         */
+  thread        consumer;       /* generator: lwp_gen_next() caller */
+  struct lwp_scope *scope;      /* the scope that will reap it      */
+  thread        scope_next;     /* its other children               */
+  thread        scope_prev;
+  struct lwp_scope *scopes;     /* innermost scope it has open      */
+  int           cancel;         /* lwp_cancel() asked it to stop    */
+  struct lwp_cleanup *cleanup;  /* lwp_cleanup_push()ed, newest first */
+  void          (*unpark)(thread t, void *where); /* undoes a park,  */
+  void          *parkedon;      /* for lwp_cancel()                 */
+  void          *local[LWP_LOCAL_INLINE]; /* lwp_setspecific() values */
+  void          **local_more;   /* keys from LWP_LOCAL_INLINE on    */
+  char          *scratch_next;  /* lwp_scratch_alloc(): next free byte */
+  char          *scratch_end;   /* and the end of that chunk        */
+  struct scratch_chunk *scratch_chunks; /* malloc'd chunks, newest first */
+  size_t        scratch_low;    /* bytes for it at the stack's low end */
 } context;
 
 typedef int (*lwpfun)(void *);  /* type for lwp function */
+typedef int (*lwpstep)(void *); /* stackless step, see lwp_stackless_create() */
+#define LWP_STEP_AGAIN (-1)     /* step isn't finished, call it again later */
+
+/* Optional creation attributes for lwp_create_attr().  NULL means defaults */
+typedef struct lwp_attr {
+  unsigned int flags;           /* LWP_ATTR_* bits below          */
+  size_t       stacksize;       /* bytes, 0 means RLIMIT_STACK   */
+  size_t       prefault;        /* bytes at the top to fault in now */
+  size_t       scratch;         /* bytes at the bottom for lwp_scratch_alloc() */
+} lwp_attr;
+
+/* Run on one of a few shared execution stacks.  Only the live part of the
+ * stack is kept while parked, copied out on switch-out and back on resume.
+ * While parked its locals are not at their addresses, another thread's
+ * frames are there, so nothing another thread writes into may be one of
+ * them: an lwp_scope, lwp_task_group, lwp_future or stage item it hands
+ * out has to be static or on the heap.
+ */
+#define LWP_ATTR_SHARED_STACK 0x1
+/* Carve the stack out of the 2MB-page arena, see lwp_arena_init().  With
+ * huge pages the slots sit back to back with no guard between them, so an
+ * overflow runs into the next thread's stack instead of being reported.
+ */
+#define LWP_ATTR_ARENA        0x2
+
+/* backing chosen by lwp_arena_init(), best first */
+#define LWP_ARENA_HUGETLB     2         /* MAP_HUGETLB pages, unguarded */
+#define LWP_ARENA_THP         1         /* madvise(MADV_HUGEPAGE), unguarded */
+#define LWP_ARENA_PAGES       0         /* 4K pages, guard gap per stack */
+
+/* Stack high-water marks, measured at lwp_exit() and collected per entry
+ * point.  Bucket i of a histogram counts threads whose peak use was below
+ * 1KB << i, so the last bucket catches anything up to 8GB.
+ */
+#define LWP_WATERMARK_OFF     0         /* don't measure                */
+#define LWP_WATERMARK_CANARY  1         /* fill new stacks, scan at exit */
+#define LWP_WATERMARK_MINCORE 2         /* count resident pages at exit */
+#define LWP_HIST_BUCKETS      24
+
+/* Per-thread accounting from lwp_stats().  Only collected when the library
+ * is built with -DLWP_STATS, otherwise lwp_stats() always returns 0.
+ */
+typedef struct lwp_stat {
+  unsigned long long oncpu_ns;          /* time spent running           */
+  unsigned long long ready_ns;          /* time runnable but not running */
+  unsigned long      switches;          /* times switched in            */
+} lwp_stat;
+
+/* Percentiles from the per-scheduler latency histograms, also LWP_STATS
+ * only: ready is admit to switch-in, slice is switch-in to switch-out. */
+typedef struct lwp_latency {
+  unsigned long      count;
+  unsigned long long p50_ns;
+  unsigned long long p90_ns;
+  unsigned long long p99_ns;
+  unsigned long long p999_ns;
+  unsigned long long max_ns;
+} lwp_latency;
+
+/* What lwp_foreach() reports for each thread, a snapshot taken without
+ * touching the scheduler.  rsp/rip are where a parked thread will resume,
+ * the backtrace is a frame-pointer walk from there, innermost first.
+ */
+#define LWP_STATE_READY       0         /* on the scheduler, not running */
+#define LWP_STATE_RUNNING     1
+#define LWP_STATE_BLOCKED     2         /* parked, e.g. in lwp_wait()    */
+#define LWP_STATE_TERMINATED  3         /* exited, waiting to be reaped  */
+#define LWP_BACKTRACE_MAX     16
+
+typedef struct lwp_info {
+  tid_t         tid;
+  int           state;                  /* LWP_STATE_*                  */
+  const char    *queue;                 /* scheduler or list it is on   */
+  lwpfun        fun;                    /* NULL for the original thread */
+  unsigned int  status;
+  size_t        stacksize;              /* 0 for the original thread    */
+  size_t        stackused;              /* bytes live when it parked    */
+  size_t        stackpeak;              /* deepest seen, if measured    */
+  unsigned long rsp;
+  unsigned long rip;
+  int           depth;                  /* entries in backtrace         */
+  unsigned long backtrace[LWP_BACKTRACE_MAX];
+} lwp_info;
+
+typedef struct lwp_stack_hist {
+  lwpfun        fun;                    /* entry point                  */
+  unsigned long count;                  /* threads measured             */
+  size_t        max;                    /* largest peak seen, bytes     */
+  unsigned long bucket[LWP_HIST_BUCKETS];
+} lwp_stack_hist;
+
+/* Fork-join: tasks spawned into a group run on at most LWP_GROUP_WORKERS
+ * threads, which take them off the group's queue one at a time and exit
+ * once it is empty; lwp_task_group_wait() runs what is still queued itself.
+ * Zero the struct (or lwp_task_group_init()) before use.
+ */
+#ifndef LWP_GROUP_WORKERS
+#define LWP_GROUP_WORKERS     4
+#endif
+/* stack size of lwp_parallel_for()'s helpers, fn runs on them too */
+#ifndef LWP_PFOR_STACKSIZE
+#define LWP_PFOR_STACKSIZE    (64 * 1024)
+#endif
+
+typedef struct lwp_task_group {
+  struct lwp_task *head;                /* spawned, not yet started     */
+  struct lwp_task *tail;
+  int           queued;                 /* tasks between head and tail  */
+  int           running;                /* workers that haven't exited  */
+  int           active;                 /* of those, in a task now      */
+  tid_t         worker[LWP_GROUP_WORKERS]; /* NO_THREAD for a free slot */
+  unsigned char busy[LWP_GROUP_WORKERS];   /* worker hasn't exited yet  */
+  unsigned long done;                   /* tasks finished               */
+  unsigned long failed;                 /* of those, non-zero or cancelled */
+  const lwp_attr *attr;                 /* for the workers, NULL for defaults */
+} lwp_task_group;
+
+typedef void (*lwprange)(long lo, long hi, void *arg); /* for lwp_parallel_for() */
+
+/* A one-shot value: lwp_future_get() parks until lwp_promise_set() has
+ * been called, which readmits everyone parked on it.  The promise is the
+ * same object, the name says which side is using it.
+ */
+typedef struct lwp_future {
+  int           ready;
+  void          *value;
+  thread        head;                   /* parked in lwp_future_get(),  */
+  thread        tail;                   /* linked through lib_one       */
+} lwp_future;
+typedef lwp_future lwp_promise;
+
+/* A graph of dependent tasks: a node is launched on its own LWP as soon as
+ * everything it depends on has finished.  Nodes and edges come out of one
+ * arena owned by the graph and go in lwp_graph_destroy().
+ */
+typedef struct lwp_graph lwp_graph;
+typedef struct lwp_node lwp_node;
+
+/* Pipeline stages: a pool of LWPs reading a bounded queue, handing each
+ * wakeup's worth of items (up to the stage's batch size) to one call of its
+ * function, which passes results on with lwp_stage_emit().  Pushing into a
+ * full queue parks the producer.  An item emitted once the next stage is
+ * closed is dropped and counted.  Counters from lwp_stage_stats().
+ */
+typedef struct lwp_stage lwp_stage;
+typedef void (*lwpbatch)(lwp_stage *s, void **items, int n, void *arg);
+
+typedef struct lwp_stage_stat {
+  unsigned long items;                  /* handed to the function       */
+  unsigned long batches;                /* calls to it, items/batches is the mean batch */
+  unsigned long full_parks;             /* producers parked on a full queue */
+  unsigned long empty_parks;            /* workers parked on an empty one */
+  unsigned long dropped;                /* emitted into a closed next stage */
+  size_t        depth;                  /* queued now                   */
+  size_t        depth_max;              /* most ever queued             */
+  size_t        capacity;
+} lwp_stage_stat;
+
+/* Structured concurrency: between lwp_scope_begin() and lwp_scope_end()
+ * every thread the caller creates, and every thread those create, belongs
+ * to the scope.  lwp_wait() never sees them; lwp_scope_end() waits for the
+ * lot and frees them together.  Scopes nest and end innermost first.
+ */
+typedef struct lwp_scope {
+  struct lwp_scope *parent;             /* the scope open before this one */
+  thread        owner;                  /* NULL if begun before lwp_start() */
+  thread        children;               /* not yet reaped, via scope_next */
+  long          live;                   /* of those, not yet exited     */
+  long          failed;                 /* exited with non-zero status  */
+  thread        waiter;                 /* owner, parked in lwp_scope_end() */
+} lwp_scope;
 
-/* Tuple that describes a scheduler */
-typedef struct scheduler {
+/* Cancellation: lwp_cancel() asks a thread to stop.  It notices the next
+ * time it blocks (or is already blocked), calls lwp_yield() or
+ * lwp_testcancel(), runs its cleanup handlers newest first, cancels and
+ * waits out the threads in any scopes it has open, and exits with
+ * LWPCANCELED(status) true.  Push a handler before taking anything a
+ * cancel would strand, pop it once that is given back.
+ */
+typedef struct lwp_cleanup {
+  void          (*fn)(void *);
+  void          *arg;
+  struct lwp_cleanup *prev;
+} lwp_cleanup;
+
+/* lwp_scratch_alloc() hands out memory owned by the calling LWP that is
+ * only given back all at once: by lwp_scratch_reset(), or when the thread
+ * is reaped.  With lwp_attr.scratch set, the first that many bytes come
+ * from the low end of the thread's own stack mapping, which a shallow
+ * thread never touches; after that it takes chunks that are recycled
+ * between threads, up to LWP_SCRATCH_POOL bytes of them.
+ */
+#define LWP_SCRATCH_CHUNK     (64 * 1024)
+#ifndef LWP_SCRATCH_POOL
+#define LWP_SCRATCH_POOL      (4 * 1024 * 1024)
+#endif
+
+/* Tuple that describes a scheduler.  C++ can't have a struct and a typedef
+ * of a different type share a name, so there the tag is lwp_scheduler. */
+#ifdef __cplusplus
+#define LWP_SCHEDULER_TAG lwp_scheduler
+#else
+#define LWP_SCHEDULER_TAG scheduler
+#endif
+typedef struct LWP_SCHEDULER_TAG {
   void   (*init)(void);            /* initialize any structures     */
   void   (*shutdown)(void);        /* tear down any structures      */
-  void   (*admit)(thread new);     /* add a thread to the pool      */
+  void   (*admit)(thread fresh);   /* add a thread to the pool      */
   void   (*remove)(thread victim); /* remove a thread from the pool */
   thread (*next)(void);            /* select a thread to schedule   */
   int    (*qlen)(void);            /* number of ready threads       */
@@ -67,6 +315,53 @@ typedef struct scheduler {
 
 /* lwp functions */
 extern tid_t lwp_create(lwpfun,void *);
+extern tid_t lwp_create_attr(lwpfun,void *,const lwp_attr *);
+extern tid_t lwp_create_inplace(lwpfun,void *,size_t reserve,void **place,const lwp_attr *);
+extern int   lwp_await(tid_t tid);
+extern tid_t lwp_join(tid_t tid, int *status);
+extern void  lwp_detach(tid_t tid);
+extern tid_t lwp_try_wait(int *status);
+extern tid_t lwp_stackless_create(lwpstep step, void *arg);
+extern int   lwp_park_join(tid_t tid);
+extern int   lwp_park_wait(void);
+extern thread lwp_gen_create(lwpfun,void *,const lwp_attr *);
+extern int   lwp_gen_next(thread gen, void **value);
+extern void  lwp_gen_yield(void *value);
+extern int   lwp_gen_destroy(thread gen);
+extern void  lwp_task_group_init(lwp_task_group *g);
+extern int   lwp_task_group_spawn(lwp_task_group *g, lwpfun fn, void *arg);
+extern unsigned long lwp_task_group_wait(lwp_task_group *g);
+extern int   lwp_parallel_for(long begin, long end, long grain, lwprange fn, void *arg);
+extern void  lwp_future_init(lwp_future *f);
+extern int   lwp_future_get(lwp_future *f, void **value);
+extern int   lwp_promise_set(lwp_promise *p, void *value);
+extern lwp_graph *lwp_graph_create(void);
+extern lwp_node *lwp_graph_node(lwp_graph *g, lwpfun fn, void *arg);
+extern int   lwp_graph_edge(lwp_graph *g, lwp_node *before, lwp_node *after);
+extern long  lwp_graph_run(lwp_graph *g);
+extern void  lwp_graph_destroy(lwp_graph *g);
+extern lwp_stage *lwp_stage_create(const char *name, int workers, size_t capacity, int batch, lwpbatch fn, void *arg);
+extern lwp_stage *lwp_stage_create_attr(const char *name, int workers, size_t capacity, int batch, lwpbatch fn, void *arg,
+                                        const lwp_attr *attr);
+extern void  lwp_stage_connect(lwp_stage *from, lwp_stage *to);
+extern int   lwp_stage_push(lwp_stage *s, void *item);
+extern int   lwp_stage_emit(lwp_stage *s, void *item);
+extern void  lwp_stage_close(lwp_stage *s);
+extern int   lwp_stage_wait(lwp_stage *s);
+extern void  lwp_stage_stats(const lwp_stage *s, lwp_stage_stat *out);
+extern void  lwp_stage_destroy(lwp_stage *s);
+extern void  lwp_scope_begin(lwp_scope *s);
+extern long  lwp_scope_end(lwp_scope *s);
+extern int   lwp_cancel(tid_t tid);
+extern void  lwp_testcancel(void);
+extern void  lwp_cleanup_push(lwp_cleanup *c, void (*fn)(void *), void *arg);
+extern void  lwp_cleanup_pop(int execute);
+extern int   lwp_key_create(lwp_key_t *key, void (*destructor)(void *));
+extern int   lwp_key_delete(lwp_key_t key);
+extern void  *lwp_getspecific(lwp_key_t key);
+extern int   lwp_setspecific(lwp_key_t key, const void *value);
+extern void  *lwp_scratch_alloc(size_t size);
+extern void  lwp_scratch_reset(void);
 extern void  lwp_exit(int status);
 extern tid_t lwp_gettid(void);
 extern void  lwp_yield(void);
@@ -75,16 +370,47 @@ extern tid_t lwp_wait(int *);
 extern void  lwp_set_scheduler(scheduler fun);
 extern scheduler lwp_get_scheduler(void);
 extern thread tid2thread(tid_t tid);
+extern size_t lwp_footprint(tid_t tid);
+extern int   lwp_arena_init(size_t nstacks, size_t stacksize);
+extern void  lwp_stack_watermarks(int mode);
+extern void  lwp_stack_pool_fill(size_t count, const lwp_attr *attr);
+extern int   lwp_stats(tid_t tid, lwp_stat *out);
+extern int   lwp_sched_latency(scheduler s, lwp_latency *ready, lwp_latency *slice);
+extern void  lwp_latency_dump(int fd);
+extern void  lwp_latency_on_signal(int sig);  /* e.g. SIGUSR1 */
+extern int   lwp_trace_start(size_t records);   /* needs -DLWP_TRACE */
+extern void  lwp_trace_stop(void);
+extern long  lwp_trace_dump(const char *path);
+extern int   lwp_stack_histogram(lwpfun fun, lwp_stack_hist *out);
+extern long  lwp_foreach(int (*fn)(const lwp_info *, void *), void *arg);
+extern void  lwp_dump(FILE *out);
+extern const char *lwp_sched_name(scheduler s);
+extern int   lwp_statpage_publish(const char *name);  /* NULL: /lwp.<pid> */
+extern void  lwp_statpage_unpublish(void);
+extern int   lwp_record_start(const char *path);
+extern long  lwp_record_stop(void);
+extern scheduler lwp_replay_load(const char *path);
+extern unsigned long lwp_replay_divergences(void);
+extern int   lwp_profile_start(int hz, size_t max_samples);
+extern void  lwp_profile_stop(void);
+extern long  lwp_profile_dump(const char *path, int per_tid);
 
 /* for lwp_wait */
 #define TERMOFFSET        8
 #define MKTERMSTAT(a,b)   ( (a)<<TERMOFFSET | ((b) & ((1<<TERMOFFSET)-1)) )
 #define LWP_TERM          1
 #define LWP_LIVE          0
+#define LWP_CANCELED      2   /* with LWP_TERM, it stopped for lwp_cancel() */
 #define LWPTERMINATED(s)  ( (((s)>>TERMOFFSET)&LWP_TERM) == LWP_TERM )
+#define LWPCANCELED(s)    ( (((s)>>TERMOFFSET)&LWP_CANCELED) == LWP_CANCELED )
 #define LWPTERMSTAT(s)    ( (s) & ((1<<TERMOFFSET)-1) )
 
 /* prototypes for asm functions */
-void swap_rfiles(rfile *old, rfile *new);
+void swap_rfiles(rfile *old, rfile *fresh);
+void *swap_rfiles_value(rfile *old, rfile *fresh, void *value);
+
+#ifdef __cplusplus
+}
+#endif
 
 #endif
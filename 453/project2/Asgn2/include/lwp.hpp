@@ -0,0 +1,265 @@
+#ifndef LWP_HPP
+#define LWP_HPP
+
+/* C++ wrapper, header only (C++17).
+ *
+ *   lwp::fiber f([&] { work(); });      // joins in its destructor
+ *   auto r = lwp::async([=] { return sum(v); });
+ *   int total = r.get();
+ *
+ * The callable, its captures and the slot for its result are placed at the
+ * top of the new LWP's own stack with lwp_create_inplace(), so a launch
+ * costs no new/malloc beyond the stack itself. They live until the thread
+ * is joined. Exceptions thrown by the callable come back out of get() or
+ * join(). Launching is fine before lwp_start(), waiting has to be done
+ * from an LWP (including main once lwp_start() has run).
+ */
+
+#include <exception>
+#include <new>
+#include <stdexcept>
+#include <type_traits>
+#include <utility>
+#include "lwp.h"
+
+namespace lwp
+{
+
+namespace detail
+{
+
+// what the launching side can see of the block at the top of the stack
+template <class R>
+struct result_slot
+{
+    alignas(R) unsigned char value[sizeof(R)];
+    bool done = false;
+    std::exception_ptr error;
+
+    R take()
+    {
+        R *r = std::launder(reinterpret_cast<R *>(value));
+        R out(std::move(*r));
+        r->~R();
+        done = false;
+        return out;
+    }
+    void discard()
+    {
+        if (done)
+        {
+            std::launder(reinterpret_cast<R *>(value))->~R();
+            done = false;
+        }
+    }
+};
+
+template <>
+struct result_slot<void>
+{
+    bool done = false;
+    std::exception_ptr error;
+
+    void take() {}
+    void discard() {}
+};
+
+template <class F, class R>
+struct frame : result_slot<R>
+{
+    F fn;
+    bool armed = false;
+
+    template <class G>
+    explicit frame(G &&g) : fn(std::forward<G>(g)) { armed = true; }
+
+    static int run(void *place)
+    {
+        // the entry point lwp_wrap() calls, place is the top of our own stack
+        frame *f = static_cast<frame *>(place);
+        if (!f->armed)
+        {
+            return 1; // copying the callable threw, the space is still zeroed
+        }
+        try
+        {
+            if constexpr (std::is_void_v<R>)
+            {
+                f->fn();
+            }
+            else
+            {
+                ::new (static_cast<void *>(f->value)) R(f->fn());
+                f->done = true;
+            }
+        }
+        catch (...)
+        {
+            f->error = std::current_exception();
+        }
+        f->fn.~F();
+        return f->error ? 1 : 0;
+    }
+};
+
+template <class R, class F>
+tid_t launch(F &&fn, result_slot<R> **slot, const lwp_attr *attr)
+{
+    using frame_t = frame<std::decay_t<F>, R>;
+    void *place = nullptr;
+    tid_t tid = lwp_create_inplace(&frame_t::run, nullptr, sizeof(frame_t), &place, attr);
+
+    if (tid == NO_THREAD)
+    {
+        throw std::runtime_error("lwp: can't create thread (shared stacks can't hold a closure)");
+    }
+    // the new thread can't run before we yield, so there is time to build its frame
+    try
+    {
+        *slot = ::new (place) frame_t(std::forward<F>(fn));
+    }
+    catch (...)
+    {
+        lwp_detach(tid); // it finds armed still zero and exits, lwp_wait() reaps it
+        throw;
+    }
+    return tid;
+}
+
+} // namespace detail
+
+// the result of an lwp::async(), get() waits for it
+template <class T>
+class future
+{
+public:
+    future() = default;
+    future(tid_t tid, detail::result_slot<T> *slot) : tid_(tid), slot_(slot) {}
+    future(future &&other) noexcept : tid_(std::exchange(other.tid_, NO_THREAD)), slot_(other.slot_) {}
+    future &operator=(future &&other) noexcept
+    {
+        if (this != &other)
+        {
+            reset();
+            tid_ = std::exchange(other.tid_, NO_THREAD);
+            slot_ = other.slot_;
+        }
+        return *this;
+    }
+    future(const future &) = delete;
+    future &operator=(const future &) = delete;
+    ~future() { reset(); }
+
+    bool valid() const { return tid_ != NO_THREAD; }
+    tid_t tid() const { return tid_; }
+    // stop tracking the thread without waiting, see fiber::detach()
+    tid_t release() { return std::exchange(tid_, NO_THREAD); }
+
+    T get()
+    {
+        // wait for the thread, take the result off its stack, then reap it
+        if (!valid())
+        {
+            throw std::logic_error("lwp::future has no thread");
+        }
+        if (lwp_await(tid_) < 0)
+        {
+            throw std::logic_error("lwp::future can't wait here");
+        }
+        std::exception_ptr error = std::move(slot_->error);
+        if (error)
+        {
+            finish();
+            std::rethrow_exception(error);
+        }
+        if constexpr (std::is_void_v<T>)
+        {
+            finish();
+        }
+        else
+        {
+            T out = slot_->take();
+            finish();
+            return out;
+        }
+    }
+
+private:
+    void finish()
+    {
+        // everything has been moved out of the slot, end its life before the stack goes
+        slot_->~result_slot<T>();
+        lwp_join(std::exchange(tid_, NO_THREAD), nullptr);
+    }
+
+    void reset()
+    {
+        // nobody asked for the result, still wait so the stack isn't freed under it
+        if (!valid())
+        {
+            return;
+        }
+        if (lwp_await(tid_) == 0)
+        {
+            slot_->discard();
+            finish();
+            return;
+        }
+        // can't wait here (before lwp_start()), let lwp_wait() have it instead
+        lwp_detach(std::exchange(tid_, NO_THREAD));
+    }
+
+    tid_t tid_ = NO_THREAD;
+    detail::result_slot<T> *slot_ = nullptr;
+};
+
+// a thread running a callable, joined when it goes out of scope unless detached
+class fiber
+{
+public:
+    fiber() = default;
+    template <class F, class = std::enable_if_t<!std::is_same_v<std::decay_t<F>, fiber>>>
+    explicit fiber(F &&fn, const lwp_attr *attr = nullptr)
+    {
+        detail::result_slot<void> *slot;
+        tid_ = detail::launch<void>(std::forward<F>(fn), &slot, attr);
+        result_ = future<void>(tid_, slot);
+    }
+    fiber(fiber &&) noexcept = default;
+    fiber &operator=(fiber &&) noexcept = default;
+    fiber(const fiber &) = delete;
+    fiber &operator=(const fiber &) = delete;
+    ~fiber() = default; // result_ joins
+
+    bool joinable() const { return result_.valid(); }
+    tid_t tid() const { return tid_; }
+
+    void join() { result_.get(); }
+
+    void detach()
+    {
+        // hand it back to lwp_wait(), it still owns its closure on its stack
+        if (joinable())
+        {
+            lwp_detach(result_.release());
+        }
+    }
+
+private:
+    tid_t tid_ = NO_THREAD;
+    future<void> result_;
+};
+
+// run fn on a new thread, the future has whatever it returns
+template <class F>
+auto async(F &&fn, const lwp_attr *attr = nullptr) -> future<std::invoke_result_t<std::decay_t<F> &>>
+{
+    using R = std::invoke_result_t<std::decay_t<F> &>;
+    detail::result_slot<R> *slot;
+    tid_t tid = detail::launch<R>(std::forward<F>(fn), &slot, attr);
+    return future<R>(tid, slot);
+}
+
+} // namespace lwp
+
+#endif
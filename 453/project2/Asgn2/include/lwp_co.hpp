@@ -0,0 +1,148 @@
+#ifndef LWP_CO_HPP
+#define LWP_CO_HPP
+
+/* C++20 coroutines as stackless LWPs, header only.
+ *
+ *   lwp::co::task handler(tid_t worker)
+ *   {
+ *       int status;
+ *       co_await lwp::co::yield();
+ *       co_await lwp::co::join(worker, &status);
+ *       co_return 0;
+ *   }
+ *   lwp::co::spawn(handler(w));
+ *
+ * spawn() hands the coroutine to lwp_stackless_create(), so it sits on the
+ * same run queue as the stackful LWPs. Each time it is picked it runs from
+ * one co_await to the next on the shared stackless stack. Between runs it
+ * costs its coroutine frame and a context, no stack. The awaiters map onto
+ * the library's blocking points: yield() is lwp_yield(), join() is
+ * lwp_join() and wait() is lwp_wait(). A task must not call the blocking C
+ * functions directly.
+ */
+
+#include <coroutine>
+#include <exception>
+#include <utility>
+#include "lwp.h"
+
+namespace lwp
+{
+namespace co
+{
+
+// the coroutine type to spawn(), co_return gives the exit status
+class task
+{
+public:
+    struct promise_type
+    {
+        int status = 0;
+
+        task get_return_object() { return task(std::coroutine_handle<promise_type>::from_promise(*this)); }
+        std::suspend_always initial_suspend() noexcept { return {}; }   // runs once scheduled
+        std::suspend_always final_suspend() noexcept { return {}; }     // the step destroys it
+        void return_value(int s) { status = s; }
+        void unhandled_exception() { std::terminate(); }                // as for std::thread
+    };
+
+    task(task &&other) noexcept : handle_(std::exchange(other.handle_, nullptr)) {}
+    task(const task &) = delete;
+    task &operator=(const task &) = delete;
+    ~task()
+    {
+        if (handle_)
+        {
+            handle_.destroy();
+        }
+    }
+
+    std::coroutine_handle<promise_type> release() { return std::exchange(handle_, nullptr); }
+
+private:
+    explicit task(std::coroutine_handle<promise_type> h) : handle_(h) {}
+    std::coroutine_handle<promise_type> handle_;
+};
+
+namespace detail
+{
+
+inline int step(void *address)
+{
+    // run to the next co_await, or to the end
+    auto h = std::coroutine_handle<task::promise_type>::from_address(address);
+    h.resume();
+    if (!h.done())
+    {
+        return LWP_STEP_AGAIN;
+    }
+    int status = h.promise().status & 0xff;
+    h.destroy();
+    return status;
+}
+
+} // namespace detail
+
+// put a task on the run queue, returns its tid
+inline tid_t spawn(task t)
+{
+    return lwp_stackless_create(detail::step, t.release().address());
+}
+
+// let everyone else have a turn
+struct yield
+{
+    bool await_ready() const noexcept { return false; }
+    void await_suspend(std::coroutine_handle<>) const noexcept {}
+    void await_resume() const noexcept {}
+};
+
+// wait for tid to exit and reap it, gives tid or NO_THREAD like lwp_join()
+class join
+{
+public:
+    explicit join(tid_t tid, int *status = nullptr) : tid_(tid), status_(status) {}
+
+    bool await_ready() const noexcept { return false; }
+    bool await_suspend(std::coroutine_handle<>) noexcept
+    {
+        parked_ = lwp_park_join(tid_);
+        return parked_ == 0;
+    }
+    tid_t await_resume() const noexcept
+    {
+        return parked_ < 0 ? NO_THREAD : lwp_join(tid_, status_);
+    }
+
+private:
+    tid_t tid_;
+    int *status_;
+    int parked_ = -1;
+};
+
+// wait for any thread to exit and reap it, gives tid or NO_THREAD like lwp_wait()
+class wait
+{
+public:
+    explicit wait(int *status = nullptr) : status_(status) {}
+
+    bool await_ready() const noexcept { return false; }
+    bool await_suspend(std::coroutine_handle<>) noexcept
+    {
+        parked_ = lwp_park_wait();
+        return parked_ == 0;
+    }
+    tid_t await_resume() const noexcept
+    {
+        return parked_ < 0 ? NO_THREAD : lwp_try_wait(status_);
+    }
+
+private:
+    int *status_;
+    int parked_ = -1;
+};
+
+} // namespace co
+} // namespace lwp
+
+#endif
@@ -0,0 +1,126 @@
+/*
+ * lwpstat: watch the counters a program publishes with
+ * lwp_statpage_publish(), once a second (or every -i seconds) until it goes
+ * away or you hit ^C. Needs nothing from the program but the mapping.
+ *
+ * usage: lwpstat [-i secs] [-n count] pid|/name
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <sched.h>
+#include <sys/mman.h>
+#include "statpage.h"
+
+static void snapshot(const statpage *page, statpage *out)
+{
+    // the seqlock reader side: an even seq that didn't move means a clean copy
+    uint64_t seq;
+
+    for (;;)
+    {
+        seq = page->seq;
+        __asm__ __volatile__("" ::: "memory");
+        memcpy(out, (const void *)page, sizeof(*out));
+        __asm__ __volatile__("" ::: "memory");
+        if (seq % 2 == 0 && seq == page->seq)
+        {
+            return;
+        }
+        sched_yield();
+    }
+}
+
+int main(int argc, char *argv[])
+{
+    const statpage *page;
+    statpage now, before;
+    char name[64];
+    double interval = 1;
+    long count = -1, i;
+    int fd, opt, first = 1;
+
+    while ((opt = getopt(argc, argv, "i:n:")) != -1)
+    {
+        switch (opt)
+        {
+        case 'i':
+            interval = atof(optarg);
+            break;
+        case 'n':
+            count = atol(optarg);
+            break;
+        default:
+            fprintf(stderr, "usage: %s [-i secs] [-n count] pid|/name\n", argv[0]);
+            exit(EXIT_FAILURE);
+        }
+    }
+    if (optind != argc - 1 || interval <= 0)
+    {
+        fprintf(stderr, "usage: %s [-i secs] [-n count] pid|/name\n", argv[0]);
+        exit(EXIT_FAILURE);
+    }
+    if (argv[optind][0] == '/')
+    {
+        snprintf(name, sizeof(name), "%s", argv[optind]);
+    }
+    else
+    {
+        snprintf(name, sizeof(name), "/lwp.%s", argv[optind]);
+    }
+
+    fd = shm_open(name, O_RDONLY, 0);
+    if (fd < 0)
+    {
+        perror(name);
+        exit(EXIT_FAILURE);
+    }
+    page = mmap(NULL, sizeof(statpage), PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (page == MAP_FAILED)
+    {
+        perror("mmap");
+        exit(EXIT_FAILURE);
+    }
+    if (memcmp(page->magic, STATPAGE_MAGIC, sizeof(page->magic)) != 0 || page->size != sizeof(statpage))
+    {
+        fprintf(stderr, "%s: not an lwp stats page, or from another version\n", name);
+        exit(EXIT_FAILURE);
+    }
+
+    for (i = 0; count < 0 || i < count; i++)
+    {
+        snapshot(page, &now);
+        if (i % 20 == 0)
+        {
+            printf("%8s %8s %8s %10s %10s %12s %6s\n", "runq", "live", "term", "created", "reaped", "switch/s", "pool");
+        }
+        printf("%8lu %8lu %8lu %10lu %10lu %12.0f %6lu\n", (unsigned long)now.runq, (unsigned long)now.live,
+               (unsigned long)now.terminated, (unsigned long)now.created, (unsigned long)now.reaped,
+               first ? 0.0 : (now.switches - before.switches) / interval, (unsigned long)now.pool);
+        if (!first)
+        {
+            int s;
+            for (s = 0; s < STATPAGE_SCHEDULERS && now.sched[s].id != 0; s++)
+            {
+                printf("    %-20s admits %10lu  picks/s %12.0f\n", now.sched[s].name,
+                       (unsigned long)now.sched[s].admits,
+                       (now.sched[s].picks - before.sched[s].picks) / interval);
+            }
+        }
+        fflush(stdout);
+        before = now;
+        first = 0;
+        if (kill(now.pid, 0) < 0)
+        {
+            printf("pid %u has gone\n", now.pid);
+            break;
+        }
+        usleep(interval * 1e6);
+    }
+    return 0;
+}
@@ -0,0 +1,1116 @@
+/*
+ * lwptest:  regression tests for the LWP library.
+ *
+ * Each test runs in a child of its own, see lwptest.h.
+ *
+ * usage: lwptest [name...]     with no names, runs them all
+ */
+
+#include <fcntl.h>
+#include <stdint.h>
+#include <time.h>
+#include <sys/mman.h>
+#include "lwp.h"
+#include "lwptest.h"
+#include "stacks.h"
+#include "statpage.h"
+#include "trace.h"
+
+static int shallow(void *arg)
+{
+    return 0;
+}
+
+// CANCELLATION
+
+static int cleaned;
+
+static void note_cleanup(void *arg)
+{
+    cleaned = *(int *)arg;
+}
+
+static int park_on_future(void *arg)
+{
+    lwp_cleanup cleanup;
+    int mark = 42;
+
+    lwp_cleanup_push(&cleanup, note_cleanup, &mark);
+    lwp_future_get(arg, NULL);
+    lwp_cleanup_pop(0);
+    return 7;
+}
+
+static int cancel_before_block(void)
+{
+    /* cancelled while still ready, it must not park when it first blocks */
+    lwp_future f;
+    tid_t tid;
+    int status;
+
+    lwp_future_init(&f);
+    tid = lwp_create(park_on_future, &f);
+    CHECK(lwp_cancel(tid) == 0);
+    lwp_start();
+    CHECK(lwp_wait(&status) == tid);
+    CHECK(LWPCANCELED(status));
+    CHECK(cleaned == 42);
+    return 0;
+}
+
+static int cancel_group_task(void)
+{
+    /* a worker cancelled inside a task must not leave it counted as active */
+    lwp_task_group g;
+    lwp_future f;
+    int i;
+
+    lwp_task_group_init(&g);
+    lwp_future_init(&f);
+    lwp_start();
+    CHECK(lwp_task_group_spawn(&g, park_on_future, &f) == 0);
+    for (i = 0; i < 10 && g.active == 0; i++)
+    {
+        lwp_yield(); // until the worker takes the task and parks in it
+    }
+    CHECK(g.active == 1);
+    CHECK(lwp_cancel(g.worker[0]) == 0);
+    CHECK(lwp_task_group_wait(&g) == 1);
+    CHECK(g.active == 0 && g.running == 0);
+    return 0;
+}
+
+static int group_stuck_worker(void)
+{
+    /* a worker parked where nothing left can wake it is detached, not leaked */
+    lwp_task_group g;
+    lwp_future f;
+    int i, status;
+
+    lwp_task_group_init(&g);
+    lwp_future_init(&f);
+    lwp_start();
+    CHECK(lwp_task_group_spawn(&g, park_on_future, &f) == 0);
+    for (i = 0; i < 10 && g.active == 0; i++)
+    {
+        lwp_yield();
+    }
+    CHECK(g.active == 1);
+    CHECK(lwp_task_group_wait(&g) == 1);
+    CHECK(g.worker[0] == NO_THREAD);
+    lwp_promise_set(&f, NULL);
+    CHECK(lwp_wait(&status) != NO_THREAD && LWPTERMSTAT(status) == 0);
+    return 0;
+}
+
+// PARALLEL FOR
+
+static tid_t piece_tid[64];
+
+static void note_piece(long lo, long hi, void *arg)
+{
+    long i;
+
+    for (i = lo; i < hi; i++)
+    {
+        piece_tid[i] = lwp_gettid();
+    }
+    if (arg != NULL)
+    {
+        lwp_yield();
+    }
+}
+
+static int parallel_for_covers(void)
+{
+    /* every index is done once, helpers step in while fn yields, and none are left */
+    int i, helped = 0;
+
+    lwp_start();
+    CHECK(lwp_parallel_for(0, 64, 4, note_piece, &helped) == 0);
+    for (i = 0; i < 64; i++)
+    {
+        CHECK(piece_tid[i] != NO_THREAD);
+        helped += piece_tid[i] != lwp_gettid();
+    }
+    CHECK(helped > 0);
+    CHECK(lwp_wait(NULL) == NO_THREAD);
+    return 0;
+}
+
+static int parallel_for_inline(void)
+{
+    /* a fn that never yields costs at most one idle helper, not a group of them */
+    tid_t before, after;
+    int i;
+
+    lwp_start();
+    before = lwp_create(shallow, NULL);
+    CHECK(lwp_parallel_for(0, 64, 1, note_piece, NULL) == 0);
+    after = lwp_create(shallow, NULL);
+    for (i = 0; i < 64; i++)
+    {
+        CHECK(piece_tid[i] == lwp_gettid());
+    }
+    CHECK(after - before <= 2);
+    return 0;
+}
+
+// SCOPES
+
+static int nested_done = 0;
+
+static int exit_with(void *arg)
+{
+    int i;
+
+    for (i = 0; i < 3; i++)
+    {
+        lwp_yield();
+    }
+    return (int)(long)arg;
+}
+
+static int spawn_grandchild(void *arg)
+{
+    /* created inside the scope, so its own child belongs to the scope too */
+    lwp_create(exit_with, NULL);
+    nested_done++;
+    return 0;
+}
+
+static int scope_reaps_all(void)
+{
+    /* lwp_scope_end() waits for every thread created in the scope, their
+    children included, counts failures, and lwp_wait() never sees them */
+    lwp_scope outer, inner;
+    tid_t outside;
+
+    lwp_start();
+    outside = lwp_create(exit_with, NULL);
+    lwp_scope_begin(&outer);
+    lwp_create(exit_with, (void *)0);
+    lwp_create(exit_with, (void *)3);
+    lwp_create(spawn_grandchild, NULL);
+    lwp_scope_begin(&inner);
+    CHECK(lwp_scope_end(&outer) == -1); // inner is still open
+    lwp_create(exit_with, (void *)1);
+    CHECK(lwp_scope_end(&inner) == 1);
+    CHECK(lwp_scope_end(&outer) == 1);
+    CHECK(outer.live == 0 && outer.children == NULL && nested_done == 1);
+    CHECK(lwp_wait(NULL) == outside);
+    CHECK(lwp_wait(NULL) == NO_THREAD);
+    return 0;
+}
+
+// LOCAL STORAGE
+
+static lwp_key_t key_inline, key_table;
+static int destroyed[3];
+
+static void destroy_value(void *value)
+{
+    /* counts each round, and sets the value again once to force another */
+    long which = (long)value;
+
+    destroyed[which]++;
+    if (which == 2 && destroyed[2] == 1)
+    {
+        lwp_setspecific(key_table, (void *)2);
+    }
+}
+
+static int set_locals(void *arg)
+{
+    lwp_setspecific(key_inline, (void *)1);
+    lwp_setspecific(key_table, arg);
+    lwp_yield();
+    return lwp_getspecific(key_inline) == (void *)1 && lwp_getspecific(key_table) == arg;
+}
+
+static int local_values(void)
+{
+    /* each thread sees its own values, inline keys and table ones alike, and
+    exiting runs the destructors, again for a value set by one of them */
+    lwp_key_t spare[LWP_LOCAL_INLINE];
+    int i, status;
+
+    CHECK(lwp_key_create(&key_inline, destroy_value) == 0);
+    for (i = 0; i < LWP_LOCAL_INLINE; i++)
+    {
+        CHECK(lwp_key_create(&spare[i], NULL) == 0); // push key_table past the inline slots
+    }
+    CHECK(lwp_key_create(&key_table, destroy_value) == 0);
+    CHECK(key_inline < LWP_LOCAL_INLINE && key_table >= LWP_LOCAL_INLINE);
+
+    lwp_create(set_locals, (void *)2);
+    lwp_create(set_locals, (void *)1);
+    lwp_start();
+    while (lwp_wait(&status) != NO_THREAD)
+    {
+        CHECK(LWPTERMSTAT(status) == 1);
+    }
+    CHECK(lwp_getspecific(key_inline) == NULL && lwp_getspecific(key_table) == NULL);
+    CHECK(destroyed[1] == 3);   // both inline values, and the second thread's table one
+    CHECK(destroyed[2] == 2);   // set again in the first round, destroyed in the second
+    CHECK(lwp_key_delete(key_table) == 0 && lwp_key_delete(key_table) == -1);
+    return 0;
+}
+
+// FUTURES AND GRAPHS
+
+static lwp_future shared_future;
+static long got[2];
+static int ngot = 0;
+
+static int wait_for_value(void *arg)
+{
+    void *value;
+
+    if (lwp_future_get(&shared_future, &value) < 0)
+    {
+        return 1;
+    }
+    got[ngot++] = (long)value + (long)arg;
+    return 0;
+}
+
+static int future_wakes_all(void)
+{
+    /* everyone parked on a future gets its value, oldest first, and it can
+    only be set once */
+    void *value;
+    int i, status;
+
+    lwp_future_init(&shared_future);
+    lwp_create(wait_for_value, (void *)1);
+    lwp_create(wait_for_value, (void *)2);
+    lwp_start();
+    for (i = 0; i < 3; i++)
+    {
+        lwp_yield(); // both park
+    }
+    CHECK(ngot == 0);
+    CHECK(lwp_promise_set(&shared_future, (void *)40) == 0);
+    CHECK(lwp_promise_set(&shared_future, (void *)50) == -1);
+    while (lwp_wait(&status) != NO_THREAD)
+    {
+        CHECK(LWPTERMSTAT(status) == 0);
+    }
+    CHECK(ngot == 2 && got[0] == 41 && got[1] == 42);
+    CHECK(lwp_future_get(&shared_future, &value) == 0 && (long)value == 40);
+    return 0;
+}
+
+static char ran[8];
+static int nran = 0;
+
+static int node_step(void *arg)
+{
+    /* a graph node: note that it ran, give the others a turn, fail if told to */
+    const char *name = arg;
+
+    ran[nran++] = name[0];
+    lwp_yield();
+    return name[1] == '!';
+}
+
+static int graph_order(void)
+{
+    /* a node runs only after everything before it, a failure skips what
+    comes after it, and cycles are refused */
+    lwp_graph *g = lwp_graph_create();
+    lwp_node *a, *b, *c, *d, *x, *y;
+
+    lwp_start();
+    a = lwp_graph_node(g, node_step, "a");
+    b = lwp_graph_node(g, node_step, "b");
+    c = lwp_graph_node(g, node_step, "c");
+    d = lwp_graph_node(g, node_step, "d");
+    lwp_graph_edge(g, a, b);
+    lwp_graph_edge(g, a, c);
+    lwp_graph_edge(g, b, d);
+    lwp_graph_edge(g, c, d);
+    CHECK(lwp_graph_run(g) == 0);
+    CHECK(nran == 4 && ran[0] == 'a' && ran[3] == 'd');
+    CHECK((ran[1] == 'b' && ran[2] == 'c') || (ran[1] == 'c' && ran[2] == 'b'));
+    nran = 0;
+    CHECK(lwp_graph_run(g) == 0 && nran == 4); // and again
+
+    x = lwp_graph_node(g, node_step, "x!");
+    y = lwp_graph_node(g, node_step, "y");
+    lwp_graph_edge(g, x, y);
+    nran = 0;
+    CHECK(lwp_graph_run(g) == 2); // x failed, y skipped
+    CHECK(nran == 5 && memchr(ran, 'y', nran) == NULL);
+
+    lwp_graph_edge(g, y, x);
+    CHECK(lwp_graph_run(g) == -1);
+    lwp_graph_destroy(g);
+    CHECK(lwp_wait(NULL) == NO_THREAD);
+    return 0;
+}
+
+// STACKS
+
+static int dig(int depth)
+{
+    volatile char frame[1024];
+
+    frame[0] = (char)depth;
+    return depth == 0 ? frame[0] : dig(depth - 1) + frame[0];
+}
+
+static int deep(void *arg)
+{
+    return dig(100) & 1;
+}
+
+static int spin(void *arg)
+{
+    for (;;)
+    {
+        lwp_yield();
+    }
+    return 0;
+}
+
+static int pool_watermark(void)
+{
+    /* a stack back from the pool must not report its last owner's pages */
+    lwp_attr attr = {0, 256 * 1024, 0};
+    lwp_stack_hist h;
+
+    lwp_stack_watermarks(LWP_WATERMARK_MINCORE);
+    lwp_stack_pool_fill(1, &attr);
+    lwp_create_attr(deep, NULL, &attr);
+    lwp_start();
+    CHECK(lwp_wait(NULL) != NO_THREAD);
+    lwp_create_attr(shallow, NULL, &attr);
+    CHECK(lwp_wait(NULL) != NO_THREAD);
+    CHECK(lwp_stack_histogram(deep, &h) == 1 && h.max >= 100 * 1024);
+    CHECK(lwp_stack_histogram(shallow, &h) == 1 && h.max <= 16 * 1024);
+    return 0;
+}
+
+static int watermark_after_create(void)
+{
+    /* threads created before watermarks were turned on aren't measured */
+    lwp_attr attr = {0, 256 * 1024, 0};
+    lwp_stack_hist h;
+
+    lwp_create_attr(shallow, NULL, &attr);
+    lwp_stack_watermarks(LWP_WATERMARK_CANARY);
+    lwp_create_attr(deep, NULL, &attr);
+    lwp_start();
+    CHECK(lwp_wait(NULL) != NO_THREAD);
+    CHECK(lwp_wait(NULL) != NO_THREAD);
+    CHECK(lwp_stack_histogram(shallow, &h) == 0);
+    CHECK(lwp_stack_histogram(deep, &h) == 1 && h.max >= 100 * 1024 && h.max < 256 * 1024);
+    return 0;
+}
+
+static int bottomless(void *arg)
+{
+    return dig(1 << 20);
+}
+
+static int overflow_report(void)
+{
+    /* running into the guard page names the thread and its stack on stderr
+    before the process dies of the SIGSEGV */
+    lwp_attr attr = {0, 64 * 1024, 0};
+    char report[512];
+    int fds[2], status;
+    ssize_t n;
+    pid_t pid;
+
+    CHECK(pipe(fds) == 0);
+    pid = fork();
+    if (pid == 0)
+    {
+        dup2(fds[1], STDERR_FILENO);
+        lwp_create_attr(bottomless, NULL, &attr); // tid 2
+        lwp_start();
+        lwp_wait(NULL);
+        exit(0);
+    }
+    close(fds[1]);
+    n = read(fds[0], report, sizeof(report) - 1);
+    CHECK(pid > 0 && waitpid(pid, &status, 0) == pid);
+    CHECK(WIFSIGNALED(status) && WTERMSIG(status) == SIGSEGV);
+    CHECK(n > 0);
+    report[n] = '\0';
+    CHECK(strncmp(report, "lwp: stack overflow in tid 2: stack 0x", 38) == 0);
+    CHECK(strstr(report, " (65536 bytes), fault at 0x") != NULL);
+    return 0;
+}
+
+// STACK ARENA
+
+static char *where[4];
+
+static int note_where(void *arg)
+{
+    char here;
+
+    where[(long)arg] = &here;
+    return 0;
+}
+
+static int deep_where(void *arg)
+{
+    note_where(arg);
+    return dig(200) & 1;
+}
+
+static int arena_slots(void)
+{
+    /* arena stacks sit side by side and a freed slot is handed out again;
+    a stack bigger than the arena's slots falls back to a mapping of its own */
+    lwp_attr fits = {LWP_ATTR_ARENA, 64 * 1024, 0};
+    lwp_attr big = {LWP_ATTR_ARENA, 256 * 1024, 0};
+    int mode = lwp_arena_init(8, 64 * 1024);
+    long apart;
+
+    CHECK(mode == LWP_ARENA_HUGETLB || mode == LWP_ARENA_THP || mode == LWP_ARENA_PAGES);
+    CHECK(lwp_arena_init(16, 1024 * 1024) == mode); // only the first call maps
+    lwp_create_attr(note_where, (void *)0, &fits);
+    lwp_create_attr(note_where, (void *)1, &fits);
+    lwp_start();
+    CHECK(lwp_wait(NULL) != NO_THREAD && lwp_wait(NULL) != NO_THREAD);
+    apart = where[1] > where[0] ? where[1] - where[0] : where[0] - where[1];
+    CHECK(apart == 64 * 1024 || apart == 64 * 1024 + sysconf(_SC_PAGE_SIZE)); // a guard gap only on 4K pages
+    CHECK((apart == 64 * 1024) == (mode != LWP_ARENA_PAGES));
+
+    lwp_create_attr(note_where, (void *)2, &fits);
+    CHECK(lwp_wait(NULL) != NO_THREAD);
+    CHECK(where[2] == where[0] || where[2] == where[1]);
+
+    lwp_create_attr(deep_where, (void *)3, &big);
+    CHECK(lwp_wait(NULL) != NO_THREAD); // 200KB deep, it would have run over a 64KB slot
+    CHECK(where[3] != where[0] && where[3] != where[1]);
+    return 0;
+}
+
+// COPY STACKS
+
+static lwp_attr shared_attr = {LWP_ATTR_SHARED_STACK, 0, 0};
+
+static int keeps_locals(void *arg)
+{
+    /* 1 if its frames come back intact every time it is resumed */
+    volatile unsigned char mine[4096];
+    unsigned char seed = (unsigned char)(uintptr_t)arg;
+    int i, round;
+
+    for (i = 0; i < (int)sizeof(mine); i++)
+    {
+        mine[i] = (unsigned char)(seed + i);
+    }
+    for (round = 0; round < 50; round++)
+    {
+        lwp_yield();
+        for (i = 0; i < (int)sizeof(mine); i++)
+        {
+            if (mine[i] != (unsigned char)(seed + i))
+            {
+                return 0;
+            }
+        }
+    }
+    return 1;
+}
+
+static int copy_stack_restores(void)
+{
+    /* more copy-stack threads than shared stacks, each finds its own locals */
+    int i, status, intact = 0;
+
+    for (i = 0; i < 3 * LWP_SHARED_STACKS; i++)
+    {
+        lwp_create_attr(keeps_locals, (void *)(uintptr_t)(i * 37), &shared_attr);
+    }
+    lwp_start();
+    while (lwp_wait(&status) != NO_THREAD)
+    {
+        intact += LWPTERMSTAT(status);
+    }
+    CHECK(intact == 3 * LWP_SHARED_STACKS);
+    return 0;
+}
+
+static int copy_stack_footprint(void)
+{
+    /* a parked copy-stack thread holds its live frames, not a whole stack */
+    lwp_attr plain = {0, 0, 0};
+    tid_t copied, whole;
+
+    copied = lwp_create_attr(spin, NULL, &shared_attr);
+    whole = lwp_create_attr(spin, NULL, &plain);
+    lwp_start();
+    lwp_yield(); // both have run and parked
+    CHECK(lwp_footprint(copied) > sizeof(context));
+    CHECK(lwp_footprint(copied) < 16 * 1024);
+    CHECK(lwp_footprint(whole) >= sizeof(context) + 64 * 1024);
+    return 0;
+}
+
+// JOIN
+
+static int join_before_start(void)
+{
+    /* before lwp_start() there is nothing to block, lwp_join() just fails,
+    and leaves the thread for lwp_wait() as if it had never been called */
+    tid_t tid = lwp_create(shallow, NULL);
+    tid_t other = lwp_create(shallow, NULL); // so the run queue alone doesn't rule it out
+    tid_t first, second;
+
+    CHECK(lwp_join(tid, NULL) == NO_THREAD);
+    lwp_start();
+    first = lwp_wait(NULL);
+    second = lwp_wait(NULL);
+    CHECK((first == tid && second == other) || (first == other && second == tid));
+    CHECK(lwp_wait(NULL) == NO_THREAD);
+    return 0;
+}
+
+// GENERATORS
+
+static int gen_counts(void *arg)
+{
+    long i;
+
+    for (i = 1; i <= 5; i++)
+    {
+        lwp_gen_yield((void *)i);
+    }
+    return 0;
+}
+
+static int generator_values(void)
+{
+    /* values come out in order, then the generator is finished and freed */
+    thread gen;
+    void *value;
+    lwp_stat st;
+    long i;
+
+    lwp_start();
+    gen = lwp_gen_create(gen_counts, NULL, NULL);
+    CHECK(gen != NULL);
+    for (i = 1; i <= 5; i++)
+    {
+        CHECK(lwp_gen_next(gen, &value) == 1);
+        CHECK((long)value == i);
+        if (i == 3 && lwp_stats(gen->tid, &st))
+        {
+            CHECK(st.switches == 3); // its switches are counted like anyone's
+        }
+    }
+    CHECK(lwp_gen_next(gen, &value) == 0);
+    CHECK(lwp_wait(NULL) == NO_THREAD); // nothing left behind to reap
+    return 0;
+}
+
+// MISUSE
+
+static int gen_exits(void *arg)
+{
+    lwp_exit(1);
+    return 0;
+}
+
+static int gen_blocks(void *arg)
+{
+    lwp_future_get(arg, NULL);
+    return 0;
+}
+
+static int generator_exit(void)
+{
+    /* a generator calling lwp_exit() aborts before touching any bookkeeping */
+    void *value;
+
+    lwp_create(shallow, NULL);
+    lwp_start();
+    lwp_gen_next(lwp_gen_create(gen_exits, NULL, NULL), &value);
+    return 0;
+}
+
+static int generator_block(void)
+{
+    /* and so does one that blocks */
+    lwp_future f;
+    void *value;
+
+    lwp_future_init(&f);
+    lwp_create(spin, NULL); // something else runnable, so lwp_future_get() would park
+    lwp_start();
+    lwp_gen_next(lwp_gen_create(gen_blocks, &f, NULL), &value);
+    return 0;
+}
+
+// STAGES
+
+static long stage_sum;
+
+static void stage_double(lwp_stage *s, void **items, int n, void *arg)
+{
+    int i;
+
+    for (i = 0; i < n; i++)
+    {
+        lwp_stage_emit(s, (void *)((long)items[i] * 2));
+    }
+}
+
+static void stage_add(lwp_stage *s, void **items, int n, void *arg)
+{
+    int i;
+
+    for (i = 0; i < n; i++)
+    {
+        stage_sum += (long)items[i];
+        lwp_yield(); // a slow consumer, so the queues fill up
+    }
+}
+
+static int stage_backpressure(void)
+{
+    /* every item gets through a two-stage pipeline, and a full queue parks
+    the producer instead of growing past its capacity */
+    lwp_attr attr = {0, 64 * 1024, 0, 0};
+    lwp_stage *doubler, *adder;
+    lwp_stage_stat st;
+    long i;
+
+    lwp_start();
+    doubler = lwp_stage_create_attr("double", 1, 2, 2, stage_double, NULL, &attr);
+    adder = lwp_stage_create_attr("add", 2, 2, 1, stage_add, NULL, &attr);
+    CHECK(doubler != NULL && adder != NULL);
+    lwp_stage_connect(doubler, adder);
+    for (i = 1; i <= 20; i++)
+    {
+        CHECK(lwp_stage_push(doubler, (void *)i) == 0);
+    }
+    lwp_stage_close(doubler);
+    CHECK(lwp_stage_wait(doubler) == 0);
+    CHECK(stage_sum == 2 * 210);
+    lwp_stage_stats(doubler, &st);
+    CHECK(st.items == 20 && st.full_parks > 0 && st.depth_max <= 2 && st.dropped == 0);
+    lwp_stage_stats(adder, &st);
+    CHECK(st.items == 20 && st.depth_max <= 2);
+    lwp_stage_destroy(doubler);
+    lwp_stage_destroy(adder);
+    CHECK(lwp_wait(NULL) == NO_THREAD);
+    return 0;
+}
+
+static int stage_drops(void)
+{
+    /* emitting into a closed stage drops the item and counts it */
+    lwp_stage *doubler, *adder;
+    lwp_stage_stat st;
+
+    lwp_start();
+    doubler = lwp_stage_create("double", 1, 4, 4, stage_double, NULL);
+    adder = lwp_stage_create("add", 1, 4, 4, stage_add, NULL);
+    lwp_stage_connect(doubler, adder);
+    lwp_stage_close(adder);
+    CHECK(lwp_stage_push(doubler, (void *)1) == 0);
+    CHECK(lwp_stage_push(doubler, (void *)2) == 0);
+    lwp_stage_close(doubler);
+    CHECK(lwp_stage_wait(doubler) == 0);
+    lwp_stage_stats(doubler, &st);
+    CHECK(st.items == 2 && st.dropped == 2);
+    CHECK(stage_sum == 0);
+    return 0;
+}
+
+static int stage_stuck_wait(void)
+{
+    /* waiting on a stage nobody closed can't finish, and says so */
+    lwp_stage *adder;
+    int i;
+
+    lwp_start();
+    adder = lwp_stage_create("add", 1, 4, 4, stage_add, NULL);
+    for (i = 0; i < 10 && lwp_get_scheduler()->qlen() > 1; i++)
+    {
+        lwp_yield(); // until the worker parks on the empty queue
+    }
+    CHECK(lwp_stage_wait(adder) == -1);
+    lwp_stage_close(adder);
+    CHECK(lwp_stage_wait(adder) == 0);
+    lwp_stage_destroy(adder);
+    return 0;
+}
+
+// SCRATCH
+
+static char *scratch_seen[3];
+
+static int scratch_user(void *arg)
+{
+    /* the stack part, then a chunk, and the stack part again after a reset */
+    char here;
+
+    scratch_seen[0] = lwp_scratch_alloc(100);
+    scratch_seen[1] = lwp_scratch_alloc(8 * 1024);
+    lwp_scratch_reset();
+    scratch_seen[2] = lwp_scratch_alloc(100);
+    return scratch_seen[0] < &here && &here - scratch_seen[0] < 64 * 1024;
+}
+
+static int scratch_reset(void)
+{
+    lwp_attr attr = {0, 64 * 1024, 0, 4096};
+    int status;
+
+    lwp_create_attr(scratch_user, NULL, &attr);
+    lwp_start();
+    CHECK(lwp_wait(&status) != NO_THREAD);
+    CHECK(LWPTERMSTAT(status) == 1); // first bytes from the bottom of its own stack
+    CHECK(((uintptr_t)scratch_seen[0] & 15) == 0);
+    CHECK(scratch_seen[1] != NULL); // past the 4096 stack bytes, from a chunk
+    CHECK(scratch_seen[2] == scratch_seen[0]);
+    return 0;
+}
+
+static char *big_chunk;
+
+static int scratch_small_then_big(void *arg)
+{
+    lwp_scratch_alloc(100);
+    big_chunk = lwp_scratch_alloc(256 * 1024);
+    return 0;
+}
+
+static int scratch_big(void *arg)
+{
+    return lwp_scratch_alloc(256 * 1024) == big_chunk;
+}
+
+static int scratch_reuse(void)
+{
+    /* a pooled chunk big enough is found even when it isn't the first one */
+    int status;
+
+    lwp_create(scratch_small_then_big, NULL);
+    lwp_start();
+    CHECK(lwp_wait(NULL) != NO_THREAD);
+    lwp_create(scratch_big, NULL);
+    CHECK(lwp_wait(&status) != NO_THREAD && LWPTERMSTAT(status) == 1);
+    return 0;
+}
+
+// STATS
+
+static int first_query_latency(void)
+{
+    /* the first lwp_stats() mustn't stall everyone else (needs -DLWP_STATS) */
+    lwp_stat st;
+    lwp_latency ready, slice;
+    int i;
+
+    lwp_create(spin, NULL);
+    lwp_start();
+    if (!lwp_stats(lwp_gettid(), &st))
+    {
+        return 0; // built without stats, nothing to check
+    }
+    for (i = 0; i < 10; i++)
+    {
+        lwp_yield();
+    }
+    CHECK(lwp_sched_latency(lwp_get_scheduler(), &ready, &slice) == 1);
+    CHECK(ready.max_ns < 5000000);
+    return 0;
+}
+
+static int lone_yield_latency(void)
+{
+    /* a thread yielding to itself spent its slices running, not waiting */
+    struct timespec t0, t1;
+    lwp_stat st;
+    lwp_latency ready, slice;
+    int i;
+
+    lwp_start();
+    if (!lwp_stats(lwp_gettid(), &st))
+    {
+        return 0;
+    }
+    for (i = 0; i < 5; i++)
+    {
+        clock_gettime(CLOCK_MONOTONIC, &t0);
+        do
+        {
+            clock_gettime(CLOCK_MONOTONIC, &t1);
+        } while ((t1.tv_sec - t0.tv_sec) * 1000000000L + t1.tv_nsec - t0.tv_nsec < 2000000);
+        lwp_yield();
+    }
+    CHECK(lwp_stats(lwp_gettid(), &st) == 1);
+    CHECK(st.ready_ns < 1000000);
+    CHECK(lwp_sched_latency(lwp_get_scheduler(), &ready, &slice) == 1);
+    CHECK(ready.max_ns < 1000000);
+    CHECK(slice.max_ns >= 1000000);
+    return 0;
+}
+
+// RECORD AND REPLAY
+
+// a scheduler that picks at random from a fixed seed, so the schedule
+// is nothing like round robin's and only the log can reproduce it
+static thread rand_q[8];
+static int rand_len = 0;
+static unsigned long rand_seed = 12345;
+
+static void rand_admit(thread t)
+{
+    rand_q[rand_len++] = t;
+}
+
+static void rand_remove(thread t)
+{
+    int i;
+
+    for (i = 0; i < rand_len && rand_q[i] != t; i++)
+        ;
+    if (i < rand_len)
+    {
+        rand_q[i] = rand_q[--rand_len];
+    }
+}
+
+static thread rand_next(void)
+{
+    rand_seed = rand_seed * 6364136223846793005UL + 1442695040888963407UL;
+    return rand_len > 0 ? rand_q[(rand_seed >> 33) % rand_len] : NULL;
+}
+
+static int rand_qlen(void)
+{
+    return rand_len;
+}
+
+static struct scheduler rand_sched = {NULL, NULL, rand_admit, rand_remove, rand_next, rand_qlen};
+
+typedef struct trail {
+    int len;
+    tid_t tid[64];
+} trail;
+
+static trail *runs; // one per child, shared with the parent
+
+static int take_turns(void *arg)
+{
+    trail *t = arg;
+    int i;
+
+    for (i = 0; i < 5; i++)
+    {
+        t->tid[t->len++] = lwp_gettid();
+        lwp_yield();
+    }
+    return 0;
+}
+
+static int play(const char *path, int replaying, trail *t)
+{
+    /* run three turn-takers, recording the schedule or replaying it. The
+    exit status is the number of divergences when replaying */
+    int i;
+
+    if (replaying)
+    {
+        lwp_set_scheduler(lwp_replay_load(path));
+    }
+    else
+    {
+        lwp_set_scheduler(&rand_sched);
+        lwp_record_start(path);
+    }
+    for (i = 0; i < 3; i++)
+    {
+        lwp_create(take_turns, t);
+    }
+    lwp_start();
+    while (lwp_wait(NULL) != NO_THREAD)
+        ;
+    if (!replaying)
+    {
+        return lwp_record_stop() > 0 ? 0 : 1;
+    }
+    return lwp_replay_divergences() != 0;
+}
+
+static int replay_identical(void)
+{
+    /* a recorded schedule replays with the same interleaving and no divergences */
+    char path[64];
+    int i, status, same_as_rr = 1;
+    pid_t pid;
+
+    snprintf(path, sizeof(path), "/tmp/lwptest.%d.sched", (int)getpid());
+    runs = mmap(NULL, 2 * sizeof(trail), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    CHECK(runs != MAP_FAILED);
+    for (i = 0; i < 2; i++)
+    {
+        pid = fork();
+        if (pid == 0)
+        {
+            exit(play(path, i, &runs[i]));
+        }
+        CHECK(pid > 0 && waitpid(pid, &status, 0) == pid);
+        CHECK(WIFEXITED(status) && WEXITSTATUS(status) == 0);
+    }
+    unlink(path);
+    CHECK(runs[0].len == 15 && runs[1].len == 15);
+    for (i = 0; i < 15; i++)
+    {
+        CHECK(runs[1].tid[i] == runs[0].tid[i]);
+        same_as_rr &= runs[0].tid[i] == (tid_t)(2 + i % 3);
+    }
+    CHECK(!same_as_rr); // or the test proves nothing
+    return 0;
+}
+
+// TRACING
+
+static int yield_thrice(void *arg)
+{
+    int i;
+
+    for (i = 0; i < 3; i++)
+    {
+        lwp_yield();
+    }
+    return 0;
+}
+
+static int trace_dump(void)
+{
+    /* the dump holds the newest records oldest first, and lwptrace turns it
+    into a JSON trace with a track and running slices per LWP (needs
+    -DLWP_TRACE, and lwptrace built next to lwptest) */
+    char path[64], cmd[96], json[16384];
+    trace_header header;
+    trace_record r, prev = {0, 0, 0};
+    FILE *f;
+    size_t n;
+    uint64_t i;
+
+    if (lwp_trace_start(1024) < 0)
+    {
+        return 0; // built without tracing, nothing to check
+    }
+    snprintf(path, sizeof(path), "/tmp/lwptest.%d.trace", (int)getpid());
+    lwp_create(yield_thrice, NULL);
+    lwp_create(yield_thrice, NULL);
+    lwp_start();
+    while (lwp_wait(NULL) != NO_THREAD)
+        ;
+    CHECK(lwp_trace_dump(path) > 0);
+    snprintf(cmd, sizeof(cmd), "./lwptrace %s", path);
+    f = popen(cmd, "r");
+    CHECK(f != NULL);
+    n = fread(json, 1, sizeof(json) - 1, f);
+    CHECK(pclose(f) == 0);
+    json[n] = '\0';
+    CHECK(strncmp(json, "{\"displayTimeUnit\": \"ns\", \"traceEvents\": [", 42) == 0);
+    CHECK(strcmp(json + n - 4, "\n]}\n") == 0);
+    CHECK(strstr(json, "\"args\": {\"name\": \"lwp 3\"}") != NULL);
+    CHECK(strstr(json, "{\"name\": \"running\", \"ph\": \"B\", \"pid\": 1, \"tid\": 2,") != NULL);
+    CHECK(strstr(json, "{\"name\": \"exit\", \"ph\": \"i\"") != NULL);
+
+    // a small ring keeps only the newest, still oldest first
+    CHECK(lwp_trace_start(4) == 0);
+    lwp_create(yield_thrice, NULL);
+    CHECK(lwp_wait(NULL) != NO_THREAD);
+    CHECK(lwp_trace_dump(path) == 4);
+    f = fopen(path, "rb");
+    CHECK(f != NULL && fread(&header, sizeof(header), 1, f) == 1);
+    CHECK(memcmp(header.magic, TRACE_MAGIC, 8) == 0 && header.count == 4);
+    for (i = 0; i < header.count; i++)
+    {
+        CHECK(fread(&r, sizeof(r), 1, f) == 1);
+        CHECK((r.when & 0xff) >= TRACE_CREATE && (r.when & 0xff) <= TRACE_EXIT);
+        CHECK(r.when >> 8 >= prev.when >> 8);
+        prev = r;
+    }
+    fclose(f);
+    unlink(path);
+    return 0;
+}
+
+// STATS PAGE
+
+static int statpage_counts(void)
+{
+    /* the page follows the pool as it fills and empties, and is gone after exit */
+    lwp_attr attr = {0, 64 * 1024, 0};
+    char name[64];
+    const statpage *page;
+    pid_t pid;
+    int fd, status;
+
+    snprintf(name, sizeof(name), "/lwptest.%d", (int)getpid());
+    pid = fork();
+    if (pid == 0)
+    {
+        if (lwp_statpage_publish(name) < 0)
+        {
+            exit(1);
+        }
+        fd = shm_open(name, O_RDONLY, 0);
+        page = mmap(NULL, sizeof(statpage), PROT_READ, MAP_SHARED, fd, 0);
+        lwp_stack_pool_fill(2, &attr);
+        CHECK(page->pool == 2);
+        lwp_create_attr(shallow, NULL, &attr);
+        CHECK(page->pool == 1);
+        exit(0);
+    }
+    CHECK(pid > 0 && waitpid(pid, &status, 0) == pid);
+    CHECK(WIFEXITED(status) && WEXITSTATUS(status) == 0);
+    CHECK(shm_open(name, O_RDONLY, 0) < 0);
+    return 0;
+}
+
+static test tests[] = {
+    {"cancel_before_block", cancel_before_block, 0},
+    {"cancel_group_task", cancel_group_task, 0},
+    {"group_stuck_worker", group_stuck_worker, 0},
+    {"parallel_for_covers", parallel_for_covers, 0},
+    {"parallel_for_inline", parallel_for_inline, 0},
+    {"scope_reaps_all", scope_reaps_all, 0},
+    {"local_values", local_values, 0},
+    {"future_wakes_all", future_wakes_all, 0},
+    {"graph_order", graph_order, 0},
+    {"pool_watermark", pool_watermark, 0},
+    {"watermark_after_create", watermark_after_create, 0},
+    {"overflow_report", overflow_report, 0},
+    {"arena_slots", arena_slots, 0},
+    {"copy_stack_restores", copy_stack_restores, 0},
+    {"copy_stack_footprint", copy_stack_footprint, 0},
+    {"join_before_start", join_before_start, 0},
+    {"generator_values", generator_values, 0},
+    {"generator_exit", generator_exit, SIGABRT},
+    {"generator_block", generator_block, SIGABRT},
+    {"stage_backpressure", stage_backpressure, 0},
+    {"stage_drops", stage_drops, 0},
+    {"stage_stuck_wait", stage_stuck_wait, 0},
+    {"scratch_reset", scratch_reset, 0},
+    {"scratch_reuse", scratch_reuse, 0},
+    {"first_query_latency", first_query_latency, 0},
+    {"lone_yield_latency", lone_yield_latency, 0},
+    {"replay_identical", replay_identical, 0},
+    {"trace_dump", trace_dump, 0},
+    {"statpage_counts", statpage_counts, 0},
+};
+
+int main(int argc, char *argv[])
+{
+    return lwptest_main(tests, sizeof(tests) / sizeof(tests[0]), argc, argv);
+}
@@ -0,0 +1,100 @@
+#ifndef LWPTEST_H
+#define LWPTEST_H
+
+/* The runner shared by the C and C++ test programs.
+ *
+ * The library's state is process-wide and lwp_start() only happens once,
+ * so every test runs in a child of its own. A test passes when its child
+ * exits 0, or for the misuse tests when it is killed by the signal they
+ * name in dies.
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <signal.h>
+#include <unistd.h>
+#include <sys/wait.h>
+
+typedef struct test {
+    const char *name;
+    int (*fn)(void);
+    int dies;                           // passes by dying of this signal, 0 for none
+} test;
+
+#define CHECK(cond)                                                         \
+    do                                                                      \
+    {                                                                       \
+        if (!(cond))                                                        \
+        {                                                                   \
+            fprintf(stderr, "%s:%d: %s\n", __FILE__, __LINE__, #cond);      \
+            return 1;                                                       \
+        }                                                                   \
+    } while (0)
+
+static int lwptest_one(const test *t)
+{
+    /* run t in a child, 1 if it passed */
+    pid_t pid;
+    int status;
+
+    fflush(stdout);
+    pid = fork();
+    if (pid == -1)
+    {
+        perror("fork");
+        exit(EXIT_FAILURE);
+    }
+    if (pid == 0)
+    {
+        if (t->dies)
+        {
+            // the death is expected, keep its diagnostic out of the way
+            if (freopen("/dev/null", "w", stderr) == NULL)
+            {
+                exit(EXIT_FAILURE);
+            }
+        }
+        exit(t->fn());
+    }
+    waitpid(pid, &status, 0);
+    if (t->dies)
+    {
+        return WIFSIGNALED(status) && WTERMSIG(status) == t->dies;
+    }
+    return WIFEXITED(status) && WEXITSTATUS(status) == 0;
+}
+
+static int lwptest_main(const test *tests, size_t count, int argc, char *argv[])
+{
+    /* run the tests named on the command line, or all of them. Returns the exit status */
+    size_t i;
+    int j, failed = 0, ran = 0;
+
+    for (i = 0; i < count; i++)
+    {
+        if (argc > 1)
+        {
+            for (j = 1; j < argc && strcmp(argv[j], tests[i].name) != 0; j++)
+                ;
+            if (j == argc)
+            {
+                continue;
+            }
+        }
+        ran++;
+        if (lwptest_one(&tests[i]))
+        {
+            printf("ok    %s\n", tests[i].name);
+        }
+        else
+        {
+            printf("FAIL  %s\n", tests[i].name);
+            failed++;
+        }
+    }
+    printf("%d/%d passed\n", ran - failed, ran);
+    return failed != 0;
+}
+
+#endif
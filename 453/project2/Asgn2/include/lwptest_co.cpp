@@ -0,0 +1,80 @@
+/*
+ * lwptest_co:  tests for the C++20 coroutine tasks in lwp_co.hpp.
+ *
+ * usage: lwptest_co [name...]     with no names, runs them all
+ */
+
+#include "lwp_co.hpp"
+#include "lwptest.h"
+
+static int trail[16];
+static int trail_len = 0;
+
+static int stackful(void *arg)
+{
+    for (int i = 0; i < 3; i++)
+    {
+        trail[trail_len++] = 10 + i;
+        lwp_yield();
+    }
+    return 5;
+}
+
+static lwp::co::task counter(int n)
+{
+    for (int i = 0; i < n; i++)
+    {
+        trail[trail_len++] = i;
+        co_await lwp::co::yield();
+    }
+    co_return n;
+}
+
+static tid_t joined;
+static int joined_status;
+
+static lwp::co::task joiner(tid_t worker)
+{
+    joined = co_await lwp::co::join(worker, &joined_status);
+    co_return 7;
+}
+
+static int coroutine_yields(void)
+{
+    /* a task and a stackful thread take turns on the same run queue */
+    int status;
+
+    lwp::co::spawn(counter(3));
+    lwp_create(stackful, nullptr);
+    lwp_start();
+    while (lwp_wait(&status) != NO_THREAD)
+        ;
+    CHECK(trail_len == 6);
+    CHECK(trail[0] == 0 && trail[1] == 10 && trail[2] == 1 && trail[3] == 11);
+    return 0;
+}
+
+static int coroutine_joins(void)
+{
+    /* co_await join() parks the task until the thread exits, then reaps it */
+    tid_t worker = lwp_create(stackful, nullptr);
+    tid_t task = lwp::co::spawn(joiner(worker));
+    int status;
+
+    lwp_start();
+    CHECK(lwp_wait(&status) == task);
+    CHECK(LWPTERMSTAT(status) == 7);
+    CHECK(joined == worker && LWPTERMSTAT(joined_status) == 5);
+    CHECK(lwp_wait(&status) == NO_THREAD); // the task reaped the worker itself
+    return 0;
+}
+
+static const test tests[] = {
+    {"coroutine_yields", coroutine_yields, 0},
+    {"coroutine_joins", coroutine_joins, 0},
+};
+
+int main(int argc, char *argv[])
+{
+    return lwptest_main(tests, sizeof(tests) / sizeof(tests[0]), argc, argv);
+}
@@ -0,0 +1,130 @@
+/*
+ * lwptest_cpp:  tests for the C++17 wrapper in lwp.hpp.
+ *
+ * usage: lwptest_cpp [name...]     with no names, runs them all
+ */
+
+#include <stdexcept>
+#include <string>
+#include <vector>
+#include "lwp.hpp"
+#include "lwptest.h"
+
+// objects alive right now, to catch anything the wrapper never destroys
+static int live = 0;
+
+struct counted
+{
+    counted() { live++; }
+    counted(const counted &) { live++; }
+    ~counted() { live--; }
+};
+
+struct throws_on_copy
+{
+    throws_on_copy() = default;
+    throws_on_copy(const throws_on_copy &) { throw std::runtime_error("copy"); }
+    int operator()() { return 0; }
+};
+
+static int fiber_joins(void)
+{
+    /* a fiber that goes out of scope is joined, its work is done by then */
+    int steps = 0;
+
+    lwp_start();
+    {
+        lwp::fiber f([&] {
+            for (int i = 0; i < 3; i++)
+            {
+                steps++;
+                lwp_yield();
+            }
+        });
+        CHECK(f.joinable());
+    }
+    CHECK(steps == 3);
+    CHECK(lwp_wait(nullptr) == NO_THREAD); // joined, nothing left over
+    return 0;
+}
+
+static int async_values(void)
+{
+    /* results of any type come back out of get(), launched before or after lwp_start() */
+    std::vector<int> v{1, 2, 3, 4};
+    auto sum = lwp::async([v] {
+        int s = 0;
+        for (int x : v)
+        {
+            s += x;
+            lwp_yield();
+        }
+        return s;
+    });
+    lwp_start();
+    auto text = lwp::async([] { return std::string(100, 'x'); });
+
+    CHECK(sum.get() == 10);
+    CHECK(text.get().size() == 100);
+    CHECK(!sum.valid() && !text.valid());
+    return 0;
+}
+
+static int async_exceptions(void)
+{
+    /* an exception comes back out of get(), and nothing is left alive after */
+    int caught = 0;
+
+    lwp_start();
+    for (int i = 0; i < 1000; i++)
+    {
+        try
+        {
+            lwp::async([]() -> int { throw counted(); }).get();
+        }
+        catch (const counted &)
+        {
+            caught++;
+        }
+    }
+    {
+        auto dropped = lwp::async([]() -> int { throw counted(); }); // reset() path
+    }
+    CHECK(caught == 1000);
+    CHECK(live == 0);
+    return 0;
+}
+
+static int launch_copy_throws(void)
+{
+    /* a callable that can't be copied onto the stack throws from async(),
+    and the thread already made for it is still reaped */
+    throws_on_copy fn;
+    int threw = 0;
+
+    lwp_start();
+    try
+    {
+        lwp::async(fn);
+    }
+    catch (const std::runtime_error &)
+    {
+        threw = 1;
+    }
+    CHECK(threw);
+    CHECK(lwp_wait(nullptr) != NO_THREAD);
+    CHECK(lwp_wait(nullptr) == NO_THREAD);
+    return 0;
+}
+
+static const test tests[] = {
+    {"fiber_joins", fiber_joins, 0},
+    {"async_values", async_values, 0},
+    {"async_exceptions", async_exceptions, 0},
+    {"launch_copy_throws", launch_copy_throws, 0},
+};
+
+int main(int argc, char *argv[])
+{
+    return lwptest_main(tests, sizeof(tests) / sizeof(tests[0]), argc, argv);
+}
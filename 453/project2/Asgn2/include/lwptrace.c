@@ -0,0 +1,118 @@
+/*
+ * lwptrace: convert a dump from lwp_trace_dump() into Chrome Trace Event
+ * JSON, which Perfetto (ui.perfetto.dev) and chrome://tracing both open.
+ *
+ * Every LWP gets its own track. The time it spends switched in shows as a
+ * "running" slice, and create/admit/block/wake/exit show as instant events
+ * on the track of the LWP they are about.
+ *
+ * usage: lwptrace dump.bin > trace.json
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include "trace.h"
+
+static const char *names[] = {"?", "create", "admit", "switch", "block", "wake", "exit"};
+
+// per tid: seen at all (for the track name), and inside a running slice
+static unsigned char *seen, *running;
+static size_t ntids = 0;
+
+static void track(FILE *out, uint32_t tid, int *first)
+{
+    // make sure the per-tid arrays cover tid, and name its track the first time
+    if (tid >= ntids)
+    {
+        size_t grown = ntids ? ntids : 64;
+        while (grown <= tid)
+        {
+            grown *= 2;
+        }
+        seen = realloc(seen, grown);
+        running = realloc(running, grown);
+        if (seen == NULL || running == NULL)
+        {
+            perror("realloc");
+            exit(EXIT_FAILURE);
+        }
+        memset(seen + ntids, 0, grown - ntids);
+        memset(running + ntids, 0, grown - ntids);
+        ntids = grown;
+    }
+    if (!seen[tid])
+    {
+        seen[tid] = 1;
+        fprintf(out, "%s\n    {\"name\": \"thread_name\", \"ph\": \"M\", \"pid\": 1, \"tid\": %u, "
+                     "\"args\": {\"name\": \"lwp %u\"}}",
+                *first ? "" : ",", tid, tid);
+        *first = 0;
+    }
+}
+
+static void slice(FILE *out, const char *ph, uint32_t tid, double us, int *first)
+{
+    fprintf(out, "%s\n    {\"name\": \"running\", \"ph\": \"%s\", \"pid\": 1, \"tid\": %u, \"ts\": %.3f}",
+            *first ? "" : ",", ph, tid, us);
+    *first = 0;
+}
+
+int main(int argc, char *argv[])
+{
+    trace_header header;
+    trace_record r;
+    FILE *in, *out = stdout;
+    uint64_t i;
+    int first = 1;
+
+    if (argc != 2)
+    {
+        fprintf(stderr, "usage: %s dump.bin > trace.json\n", argv[0]);
+        exit(EXIT_FAILURE);
+    }
+    in = fopen(argv[1], "rb");
+    if (in == NULL)
+    {
+        perror(argv[1]);
+        exit(EXIT_FAILURE);
+    }
+    if (fread(&header, sizeof(header), 1, in) != 1 || memcmp(header.magic, TRACE_MAGIC, sizeof(header.magic)) != 0)
+    {
+        fprintf(stderr, "%s: not an lwp trace dump\n", argv[1]);
+        exit(EXIT_FAILURE);
+    }
+
+    fprintf(out, "{\"displayTimeUnit\": \"ns\", \"traceEvents\": [");
+    for (i = 0; i < header.count && fread(&r, sizeof(r), 1, in) == 1; i++)
+    {
+        int type = r.when & 0xff;
+        double us = (r.when >> 8) * header.ns_per_tick / 1000.0;
+
+        track(out, r.tid, &first);
+        if (type == TRACE_SWITCH)
+        {
+            // a slice may have started before the ring did, only close ones we opened
+            track(out, r.arg, &first);
+            if (running[r.tid])
+            {
+                slice(out, "E", r.tid, us, &first);
+                running[r.tid] = 0;
+            }
+            slice(out, "B", r.arg, us, &first);
+            running[r.arg] = 1;
+            continue;
+        }
+        if (type == TRACE_EXIT && running[r.tid])
+        {
+            slice(out, "E", r.tid, us, &first);
+            running[r.tid] = 0;
+        }
+        fprintf(out, ",\n    {\"name\": \"%s\", \"ph\": \"i\", \"s\": \"t\", \"pid\": 1, \"tid\": %u, "
+                     "\"ts\": %.3f, \"args\": {\"arg\": %u}}",
+                type < (int)(sizeof(names) / sizeof(names[0])) ? names[type] : "?", r.tid, us, r.arg);
+    }
+    fprintf(out, "\n]}\n");
+    fclose(in);
+    return 0;
+}
@@ -0,0 +1,60 @@
+#ifndef PROBES_H
+#define PROBES_H
+
+/* USDT probes, provider "lwp", for bpftrace/perf/systemtap to attach to a
+ * running program without a rebuild:
+ *
+ *   create(tid, creator)   switch(from, to)   block(tid)
+ *   wake(tid, waker)       exit(tid, status)  reap(tid, status)
+ *
+ * Each probe is a single nop in the code plus a .note.stapsdt entry that
+ * says where the nop is and where to find the arguments. The tracer
+ * patches the nop to a breakpoint when it attaches, so an unattached probe
+ * costs the nop and nothing else. List them with
+ *
+ *   readelf -n nums | grep -A4 stapsdt
+ *
+ * This is the layout <sys/sdt.h> emits, written out so the library builds
+ * on machines without systemtap's headers. -DLWP_NO_PROBES compiles them out.
+ */
+
+#if defined(LWP_NO_PROBES) || !defined(__x86_64__)
+#define PROBE1(name, a)
+#define PROBE2(name, a, b)
+#else
+
+// the note, then a shared zero-size anchor the tracer uses to undo prelinking
+#define PROBE_NOTE(name, args)                                                  \
+    "990: nop\n"                                                                \
+    ".pushsection .note.stapsdt,\"?\",\"note\"\n"                               \
+    ".balign 4\n"                                                               \
+    ".4byte 992f-991f, 994f-993f, 3\n"                                          \
+    "991: .asciz \"stapsdt\"\n"                                                 \
+    "992: .balign 4\n"                                                          \
+    "993: .8byte 990b\n"                                                        \
+    ".8byte _.stapsdt.base\n"                                                   \
+    ".8byte 0\n"                                                                \
+    ".asciz \"lwp\"\n"                                                          \
+    ".asciz \"" #name "\"\n"                                                    \
+    ".asciz \"" args "\"\n"                                                     \
+    "994: .balign 4\n"                                                          \
+    ".popsection\n"                                                             \
+    ".ifndef _.stapsdt.base\n"                                                  \
+    ".pushsection .stapsdt.base,\"aG\",\"progbits\",.stapsdt.base,comdat\n"     \
+    ".weak _.stapsdt.base\n"                                                    \
+    ".hidden _.stapsdt.base\n"                                                  \
+    "_.stapsdt.base: .space 1\n"                                                \
+    ".size _.stapsdt.base, 1\n"                                                 \
+    ".popsection\n"                                                             \
+    ".endif\n"
+
+// arguments are 8 byte unsigned, wherever the compiler already has them
+#define PROBE1(name, a)                                                         \
+    __asm__ __volatile__(PROBE_NOTE(name, "8@%0")                               \
+                         : : "nor"((unsigned long)(a)))
+#define PROBE2(name, a, b)                                                      \
+    __asm__ __volatile__(PROBE_NOTE(name, "8@%0 8@%1")                          \
+                         : : "nor"((unsigned long)(a)), "nor"((unsigned long)(b)))
+#endif
+
+#endif
@@ -0,0 +1,274 @@
+#define _GNU_SOURCE
+#include "lwp.h"
+#include "stacks.h"
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <signal.h>
+#include <dlfcn.h>
+#include <ucontext.h>
+#include <sys/time.h>
+
+/* Sampling profiler. SIGPROF fires every 1/hz of CPU time, the handler
+ * notes the running lwp and walks its frame pointers, never leaving that
+ * lwp's own stack, into a preallocated buffer. Only code built with frame
+ * pointers (the default without -O, or -fno-omit-frame-pointer) walks
+ * past the leaf. lwp_profile_dump() folds the samples into collapsed
+ * stacks, one line per distinct stack, rooted at the lwp's entry point:
+ *
+ *   [worker];worker;crunch;memcpy 112
+ *
+ * which flamegraph.pl and speedscope read as is.
+ */
+
+#define PROFILE_DEPTH   30
+#define PROFILE_DEFAULT 16384
+
+typedef struct profile_sample {
+    lwpfun        fun;                  // entry point, NULL for the original thread
+    tid_t         tid;
+    unsigned long depth;
+    unsigned long pc[PROFILE_DEPTH];    // leaf first
+} profile_sample;
+
+extern thread current; // from lwp.c
+
+static profile_sample *samples = NULL;
+static size_t nsamples = 0, maxsamples = 0;
+static unsigned long dropped = 0;
+static struct sigaction old_action;
+static int profiling = 0;
+
+static void profile_handler(int sig, siginfo_t *info, void *ucontext)
+{
+    greg_t *regs = ((ucontext_t *)ucontext)->uc_mcontext.gregs;
+    thread t = current;
+    profile_sample *s;
+    unsigned long lo, hi, fp;
+
+    if (t == NULL || samples == NULL)
+    {
+        return;
+    }
+    if (nsamples == maxsamples)
+    {
+        dropped++;
+        return;
+    }
+    s = &samples[nsamples];
+    s->fun = t->fun;
+    s->tid = t->tid;
+    s->pc[0] = regs[REG_RIP];
+    s->depth = 1;
+
+    // each frame is [saved rbp][return address], stop at anything outside the stack
+    stack_bounds(t, &lo, &hi);
+    fp = regs[REG_RBP];
+    while (s->depth < PROFILE_DEPTH && fp >= lo && fp + 2 * sizeof(unsigned long) <= hi && fp % sizeof(unsigned long) == 0)
+    {
+        unsigned long *frame = (unsigned long *)fp;
+        if (frame[1] == 0)
+        {
+            // lwp_wrap's return address, the pc before it is lwp_wrap itself
+            if (t->fun != NULL && s->depth > 1)
+            {
+                s->depth--;
+            }
+            break;
+        }
+        s->pc[s->depth++] = frame[1];
+        if (frame[0] <= fp)
+        {
+            break;
+        }
+        fp = frame[0];
+    }
+    nsamples++;
+}
+
+int lwp_profile_start(int hz, size_t max_samples)
+{
+    /* start sampling hz times a second of CPU time, keeping up to max_samples
+    (0 for a default). Samples from an earlier run are thrown away. Returns
+    0, or -1 if the buffer or the timer can't be set up */
+    struct sigaction sa;
+    struct itimerval it;
+
+    if (hz <= 0 || hz > 1000000)
+    {
+        return -1;
+    }
+    lwp_profile_stop();
+    free(samples);
+    maxsamples = max_samples != 0 ? max_samples : PROFILE_DEFAULT;
+    samples = malloc(maxsamples * sizeof(profile_sample));
+    if (samples == NULL)
+    {
+        perror("Error allocating profile samples");
+        maxsamples = 0;
+        return -1;
+    }
+    nsamples = 0;
+    dropped = 0;
+
+    stack_bounds_init(); // the handler can't ask for the original thread's stack itself
+
+    sa.sa_sigaction = profile_handler;
+    sigemptyset(&sa.sa_mask);
+    sa.sa_flags = SA_SIGINFO | SA_RESTART;
+    if (sigaction(SIGPROF, &sa, &old_action) < 0)
+    {
+        perror("sigaction");
+        return -1;
+    }
+    it.it_interval.tv_sec = 0;
+    it.it_interval.tv_usec = 1000000 / hz;
+    it.it_value = it.it_interval;
+    if (setitimer(ITIMER_PROF, &it, NULL) < 0)
+    {
+        perror("setitimer");
+        sigaction(SIGPROF, &old_action, NULL);
+        return -1;
+    }
+    profiling = 1;
+    return 0;
+}
+
+void lwp_profile_stop(void)
+{
+    /* stop sampling, what was collected stays around for lwp_profile_dump() */
+    struct itimerval it;
+
+    if (!profiling)
+    {
+        return;
+    }
+    memset(&it, 0, sizeof(it));
+    setitimer(ITIMER_PROF, &it, NULL);
+    sigaction(SIGPROF, &old_action, NULL);
+    profiling = 0;
+}
+
+static int line_cmp(const void *a, const void *b)
+{
+    return strcmp(*(char *const *)a, *(char *const *)b);
+}
+
+static void symbolize(FILE *out, unsigned long pc)
+{
+    // name from the dynamic symbol table, else module+offset for addr2line, else the raw pc
+    Dl_info info;
+    int found = dladdr((void *)pc, &info); // info is untouched when it fails
+
+    if (found && info.dli_sname != NULL)
+    {
+        fputs(info.dli_sname, out);
+    }
+    else if (found && info.dli_fname != NULL && info.dli_fbase != NULL)
+    {
+        const char *name = strrchr(info.dli_fname, '/');
+        fprintf(out, "%s+0x%lx", name != NULL ? name + 1 : info.dli_fname, pc - (unsigned long)info.dli_fbase);
+    }
+    else
+    {
+        fprintf(out, "0x%lx", pc);
+    }
+}
+
+static char *collapse(profile_sample *s, int per_tid)
+{
+    // one sample as "[entry];outermost;...;leaf", a malloc'd string
+    char *line = NULL;
+    size_t len = 0;
+    unsigned long k;
+    FILE *out = open_memstream(&line, &len);
+
+    if (out == NULL)
+    {
+        perror("open_memstream");
+        exit(EXIT_FAILURE);
+    }
+    fputc('[', out);
+    if (s->fun != NULL)
+    {
+        symbolize(out, (unsigned long)s->fun);
+    }
+    else
+    {
+        fputs("main", out);
+    }
+    if (per_tid)
+    {
+        fprintf(out, " tid %lu", s->tid);
+    }
+    fputc(']', out);
+    for (k = s->depth; k > 0; k--)
+    {
+        fputc(';', out);
+        // return addresses point after the call, back up one to stay inside the caller
+        symbolize(out, k == 1 ? s->pc[0] : s->pc[k - 1] - 1);
+    }
+    fclose(out);
+    return line;
+}
+
+long lwp_profile_dump(const char *path, int per_tid)
+{
+    /* write the samples taken so far to path as collapsed stacks, one root per
+    entry point, or per lwp when per_tid is set. Sampling is paused while this
+    runs. Returns the number of lines written or -1 */
+    FILE *out;
+    char **lines;
+    size_t i, j, n = nsamples;
+    long written = 0;
+    int was_profiling = profiling;
+    struct itimerval it, saved;
+
+    if (samples == NULL)
+    {
+        return -1;
+    }
+    lines = malloc((n + 1) * sizeof(char *));
+    out = fopen(path, "w");
+    if (lines == NULL || out == NULL)
+    {
+        perror(path);
+        free(lines);
+        if (out != NULL)
+        {
+            fclose(out);
+        }
+        return -1;
+    }
+    memset(&it, 0, sizeof(it));
+    setitimer(ITIMER_PROF, &it, &saved);
+
+    // samples that symbolize the same are the same stack, whatever the exact pcs
+    for (i = 0; i < n; i++)
+    {
+        lines[i] = collapse(&samples[i], per_tid);
+    }
+    qsort(lines, n, sizeof(char *), line_cmp);
+    for (i = 0; i < n; i = j)
+    {
+        for (j = i + 1; j < n && strcmp(lines[i], lines[j]) == 0; j++)
+        {
+            free(lines[j]);
+        }
+        fprintf(out, "%s %zu\n", lines[i], j - i);
+        free(lines[i]);
+        written++;
+    }
+    free(lines);
+    if (dropped != 0)
+    {
+        fprintf(stderr, "lwp_profile_dump: buffer was full, %lu samples dropped\n", dropped);
+    }
+    fclose(out);
+
+    if (was_profiling)
+    {
+        setitimer(ITIMER_PROF, &saved, NULL);
+    }
+    return written;
+}
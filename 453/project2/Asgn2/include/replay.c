@@ -0,0 +1,242 @@
+#include "lwp.h"
+#include "replay.h"
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+
+// recording side
+uint32_t *replay_log = NULL;
+size_t replay_len = 0, replay_cap = 0;
+static char record_path[256];
+
+// replay side: the loaded log, and a cursor each for picks and wakes
+uint32_t *replay_in = NULL;
+static size_t replay_count = 0, pick_at = 0, wake_at = 0;
+static unsigned long divergences = 0;
+
+// ready threads, in admit order through sched_one/sched_two, and by tid for the picks
+static thread ready_head = NULL, ready_tail = NULL;
+static int ready_count = 0;
+static thread *by_tid = NULL;
+static size_t by_tid_len = 0;
+
+void replay_grow(void)
+{
+    size_t cap = replay_cap * 2;
+    uint32_t *log = realloc(replay_log, cap * sizeof(uint32_t));
+    if (log == NULL)
+    {
+        perror("Error growing schedule log");
+        exit(EXIT_FAILURE);
+    }
+    replay_log = log;
+    replay_cap = cap;
+}
+
+int lwp_record_start(const char *path)
+{
+    /* log scheduling decisions until lwp_record_stop(), which writes them to
+    path. Returns 0, or -1 if the log can't be allocated */
+    free(replay_log);
+    replay_len = 0;
+    replay_cap = 4096;
+    replay_log = malloc(replay_cap * sizeof(uint32_t));
+    if (replay_log == NULL)
+    {
+        perror("Error allocating schedule log");
+        replay_cap = 0;
+        return -1;
+    }
+    snprintf(record_path, sizeof(record_path), "%s", path);
+    return 0;
+}
+
+long lwp_record_stop(void)
+{
+    /* stop recording and write the log. Returns the number of entries or -1 */
+    replay_header header;
+    uint32_t *log = replay_log;
+    FILE *out;
+
+    if (log == NULL)
+    {
+        return -1;
+    }
+    replay_log = NULL;
+    out = fopen(record_path, "wb");
+    if (out == NULL)
+    {
+        perror(record_path);
+        free(log);
+        return -1;
+    }
+    memcpy(header.magic, REPLAY_MAGIC, sizeof(header.magic));
+    header.count = replay_len;
+    fwrite(&header, sizeof(header), 1, out);
+    fwrite(log, sizeof(uint32_t), replay_len, out);
+    fclose(out);
+    free(log);
+    return header.count;
+}
+
+void replay_check_wake(tid_t tid)
+{
+    // the library picks who to wake itself, so a different one means the runs have parted
+    while (wake_at < replay_count && (replay_in[wake_at] & 1) != REPLAY_WAKE)
+    {
+        wake_at++;
+    }
+    if (wake_at == replay_count || replay_in[wake_at] >> 1 != tid)
+    {
+        divergences++;
+    }
+    if (wake_at < replay_count)
+    {
+        wake_at++;
+    }
+}
+
+/*********************************************************
+ * the Replay scheduler
+ *********************************************************/
+
+static void replay_admit(thread new)
+{
+    if (new->tid >= by_tid_len)
+    {
+        size_t len = by_tid_len ? by_tid_len : 1024;
+        thread *grown;
+        while (len <= new->tid)
+        {
+            len *= 2;
+        }
+        grown = realloc(by_tid, len * sizeof(thread));
+        if (grown == NULL)
+        {
+            perror("Error growing replay index");
+            exit(EXIT_FAILURE);
+        }
+        memset(grown + by_tid_len, 0, (len - by_tid_len) * sizeof(thread));
+        by_tid = grown;
+        by_tid_len = len;
+    }
+    by_tid[new->tid] = new;
+
+    new->sched_one = NULL;
+    new->sched_two = ready_tail;
+    if (ready_tail != NULL)
+    {
+        ready_tail->sched_one = new;
+    }
+    else
+    {
+        ready_head = new;
+    }
+    ready_tail = new;
+    ready_count++;
+}
+
+static void replay_remove(thread victim)
+{
+    if (victim->tid >= by_tid_len || by_tid[victim->tid] != victim)
+    {
+        return; // not one of ours
+    }
+    by_tid[victim->tid] = NULL;
+    if (victim->sched_two != NULL)
+    {
+        victim->sched_two->sched_one = victim->sched_one;
+    }
+    else
+    {
+        ready_head = victim->sched_one;
+    }
+    if (victim->sched_one != NULL)
+    {
+        victim->sched_one->sched_two = victim->sched_two;
+    }
+    else
+    {
+        ready_tail = victim->sched_two;
+    }
+    victim->sched_one = NULL;
+    victim->sched_two = NULL;
+    ready_count--;
+}
+
+static thread replay_next(void)
+{
+    /* the thread the log says was picked next. When it isn't ready, or
+    the log has run out, fall back to round robin so the run still finishes */
+    thread picked;
+
+    while (pick_at < replay_count && (replay_in[pick_at] & 1) != REPLAY_PICK)
+    {
+        pick_at++;
+    }
+    if (pick_at < replay_count)
+    {
+        tid_t tid = replay_in[pick_at++] >> 1;
+        if (tid < by_tid_len && by_tid[tid] != NULL)
+        {
+            return by_tid[tid];
+        }
+        divergences++;
+    }
+    picked = ready_head;
+    if (picked != NULL && picked != ready_tail)
+    {
+        replay_remove(picked);
+        replay_admit(picked);
+    }
+    return picked;
+}
+
+static int replay_qlen(void)
+{
+    return ready_count;
+}
+
+static struct scheduler replay_publish = {NULL, NULL, replay_admit, replay_remove, replay_next, replay_qlen};
+
+scheduler lwp_replay_load(const char *path)
+{
+    /* read a log from lwp_record_stop() and return a scheduler that plays it
+    back, for lwp_set_scheduler(). NULL if the file isn't a schedule log */
+    replay_header header;
+    uint32_t *log;
+    FILE *in = fopen(path, "rb");
+
+    if (in == NULL)
+    {
+        perror(path);
+        return NULL;
+    }
+    if (fread(&header, sizeof(header), 1, in) != 1 || memcmp(header.magic, REPLAY_MAGIC, sizeof(header.magic)) != 0)
+    {
+        fprintf(stderr, "%s: not a schedule log\n", path);
+        fclose(in);
+        return NULL;
+    }
+    log = malloc((header.count + 1) * sizeof(uint32_t));
+    if (log == NULL || fread(log, sizeof(uint32_t), header.count, in) != header.count)
+    {
+        fprintf(stderr, "%s: short schedule log\n", path);
+        free(log);
+        fclose(in);
+        return NULL;
+    }
+    fclose(in);
+    free(replay_in);
+    replay_in = log;
+    replay_count = header.count;
+    pick_at = wake_at = 0;
+    divergences = 0;
+    return &replay_publish;
+}
+
+unsigned long lwp_replay_divergences(void)
+{
+    /* decisions that couldn't be replayed as logged, 0 means an identical run */
+    return divergences;
+}
@@ -0,0 +1,55 @@
+#ifndef REPLAY_H
+#define REPLAY_H
+
+#include <stdint.h>
+
+/* Schedule record/replay. lwp_record_start() logs every thread the
+ * scheduler picks and every waiter lwp_exit() wakes, in order, as one
+ * 32-bit word each: tid << 1 | kind. lwp_record_stop() writes the log
+ * after this header. lwp_replay_load() turns a log into a scheduler that
+ * makes the same picks, so two builds can be timed on the same
+ * interleaving. Recording costs a store per decision, and nothing
+ * unless it is on. */
+
+#define REPLAY_MAGIC "LWPSCHED"
+#define REPLAY_PICK  0
+#define REPLAY_WAKE  1
+
+typedef struct replay_header {
+    char     magic[8];
+    uint64_t count;             // entries that follow
+} replay_header;
+
+#ifdef LWPH
+extern uint32_t *replay_log;
+extern size_t replay_len, replay_cap;
+void replay_grow(void);
+
+static inline void replay_note(int kind, tid_t tid)
+{
+    if (replay_log == NULL)
+    {
+        return;
+    }
+    if (replay_len == replay_cap)
+    {
+        replay_grow();
+    }
+    replay_log[replay_len++] = (uint32_t)tid << 1 | kind;
+}
+
+// when replaying, wakes are checked against the log too
+extern uint32_t *replay_in;
+void replay_check_wake(tid_t tid);
+
+static inline void replay_wake(tid_t tid)
+{
+    replay_note(REPLAY_WAKE, tid);
+    if (replay_in != NULL)
+    {
+        replay_check_wake(tid);
+    }
+}
+#endif
+
+#endif
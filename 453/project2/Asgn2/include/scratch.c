@@ -0,0 +1,111 @@
+#include "lwp.h"
+#include "scratch.h"
+#include <stdlib.h>
+#include <stdio.h>
+
+extern thread current;
+
+// chunks given back by reset or reaped threads, ready for the next one to need more
+static scratch_chunk *chunk_pool = NULL;
+static size_t pool_bytes = 0;   // held in chunk_pool, at most LWP_SCRATCH_POOL
+
+void scratch_stack(thread t, size_t bytes)
+{
+    /* start t's scratch space in the low bytes of its stack, which the caller has checked it can spare */
+    t->scratch_low = bytes;
+    t->scratch_next = (char *)t->stack;
+    t->scratch_end = t->scratch_next + bytes;
+}
+
+static int scratch_refill(thread t, size_t size)
+{
+    /* a chunk with room for size more bytes, the first one in the pool that is big enough or a new one */
+    scratch_chunk **link = &chunk_pool;
+    scratch_chunk *c;
+    size_t want = size + sizeof(scratch_chunk);
+
+    if (want < LWP_SCRATCH_CHUNK)
+    {
+        want = LWP_SCRATCH_CHUNK;
+    }
+    while (*link != NULL && (*link)->size < want)
+    {
+        link = &(*link)->next;
+    }
+    if ((c = *link) != NULL)
+    {
+        *link = c->next;
+        pool_bytes -= c->size;
+    }
+    else
+    {
+        c = malloc(want);
+        if (c == NULL)
+        {
+            perror("Error allocating scratch chunk");
+            return -1;
+        }
+        c->size = want;
+    }
+    c->next = t->scratch_chunks;
+    t->scratch_chunks = c;
+    t->scratch_next = (char *)(c + 1);
+    t->scratch_end = (char *)c + c->size;
+    return 0;
+}
+
+void *lwp_scratch_alloc(size_t size)
+{
+    /* size bytes, 16 aligned, that live until the calling LWP is reaped or
+    calls lwp_scratch_reset(). NULL outside an LWP or if out of memory */
+    thread t = current;
+    void *p;
+
+    if (t == NULL)
+    {
+        return NULL;
+    }
+    size = (size + 15) & ~(size_t)15;
+    if ((size_t)(t->scratch_end - t->scratch_next) < size && scratch_refill(t, size) < 0)
+    {
+        return NULL;
+    }
+    p = t->scratch_next;
+    t->scratch_next += size;
+    return p;
+}
+
+void scratch_release(thread t)
+{
+    /* give back everything t allocated: its chunks go to the pool while it
+    is under LWP_SCRATCH_POOL bytes, the rest to free(), and the stack part
+    starts over, however much was used */
+    scratch_chunk *c, *next;
+
+    for (c = t->scratch_chunks; c != NULL; c = next)
+    {
+        next = c->next;
+        if (pool_bytes + c->size <= LWP_SCRATCH_POOL)
+        {
+            c->next = chunk_pool;
+            chunk_pool = c;
+            pool_bytes += c->size;
+        }
+        else
+        {
+            free(c);
+        }
+    }
+    t->scratch_chunks = NULL;
+    t->scratch_next = t->scratch_low != 0 ? (char *)t->stack : NULL;
+    t->scratch_end = t->scratch_next != NULL ? t->scratch_next + t->scratch_low : NULL;
+}
+
+void lwp_scratch_reset(void)
+{
+    /* free everything the calling LWP has lwp_scratch_alloc()ed, e.g. between requests */
+    if (current != NULL)
+    {
+        scratch_release(current);
+    }
+}
@@ -0,0 +1,15 @@
+#ifndef SCRATCH_H
+#define SCRATCH_H
+
+#include "lwp.h"
+
+// lwp_scratch_alloc() chunks: a header, then the memory handed out
+typedef struct scratch_chunk {
+    struct scratch_chunk *next;
+    size_t size;            // bytes including this header
+} scratch_chunk;
+
+void scratch_stack(thread t, size_t bytes);
+void scratch_release(thread t);
+
+#endif
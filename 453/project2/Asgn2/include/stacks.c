@@ -0,0 +1,822 @@
+#define _GNU_SOURCE
+#include "stacks.h"
+#include "statpage.h"
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <signal.h>
+#include <pthread.h>
+#include <sys/resource.h>
+#include <sys/mman.h>
+
+#ifndef MADV_POPULATE_WRITE
+#define MADV_POPULATE_WRITE 23 // Linux 5.14, older headers don't have it
+#endif
+
+// execution stacks shared by the copy-stack threads, handed out round robin
+static shared_stack shared_stacks[LWP_SHARED_STACKS];
+static int shared_next = 0;
+
+// small private stack for the copy itself. When the outgoing thread is standing
+// on the stack we need to overwrite we hop over here first, do the copy, then load.
+#define TRAMPOLINE_WORDS 8192
+static unsigned long trampoline_stack[TRAMPOLINE_WORDS] __attribute__((aligned(16)));
+static rfile trampoline_state;
+static int trampoline_ready = 0;
+
+// one big mapping that LWP_ATTR_ARENA stacks are carved from, so that many small
+// stacks share a handful of 2MB TLB entries instead of one 4K entry per page
+static struct {
+    char *base;
+    size_t size;
+    size_t slot;            // stack plus guard gap, a multiple of the page size
+    size_t guard;           // PROT_NONE bytes at the low end of each slot
+    size_t stacksize;
+    size_t next;            // offset of the first never-used slot
+    unsigned long **free;   // recycled slots, kept off the slots so watermarks don't see them
+    size_t nfree;
+    int mode;               // LWP_ARENA_*
+} arena;
+
+// SIGSEGV on a guard page happens with the stack already full, so the
+// handler gets a stack of its own
+static char guard_altstack[64 * 1024];
+static struct sigaction previous_segv;
+static int guard_installed = 0;
+
+// stacks kept mapped for reuse, only ever as many as lwp_stack_pool_fill()
+// has made. The bookkeeping lives off the stacks so no watermark sees it
+typedef struct pooled_stack {
+    struct pooled_stack *next;
+    unsigned long *stack;
+    size_t size;
+} pooled_stack;
+static pooled_stack *pool = NULL;
+static size_t pool_count = 0;
+static size_t pool_limit = 0;
+static size_t pool_warm = 0;    // bytes at the top of a parked stack left resident
+
+// the original thread's stack belongs to the C library, found once on demand
+static unsigned long main_lo = 0, main_hi = 0;
+
+// high-water mark collection, one histogram per entry point
+#define STACK_CANARY 0x5afec0de5afec0deUL
+static int watermark_mode = LWP_WATERMARK_OFF;
+static lwp_stack_hist *histograms = NULL;
+static size_t histogram_count = 0;
+
+size_t stack_default_size(void)
+{
+    // Determine how big the stack should be using sysconf(3)
+    long page_size = sysconf(_SC_PAGE_SIZE);
+    struct rlimit rlp;
+    size_t resource_limit;
+
+    // Get the value of the resource limit for the stack size (RLIMIT_STACK) using getrlimit(2). Use the soft limit
+    int result = getrlimit(RLIMIT_STACK, &rlp);
+
+    // If RLIMIT_STACK does not exist or if its value is RLIM_INFINITY, use a stack size of 8MB.
+    if (result == -1 || rlp.rlim_cur == RLIM_INFINITY)
+    {
+        resource_limit = 8 * 1024 * 1024;
+    }
+    else
+    {
+        resource_limit = rlp.rlim_cur;
+        // make sure the resouce limit is a multiple of the page size, otherwise round up to the nearest multiple of the page size
+        if (resource_limit % page_size != 0)
+        {
+            resource_limit = resource_limit + (page_size - (resource_limit % page_size));
+        }
+    }
+    return resource_limit;
+}
+
+static size_t guard_size(void)
+{
+    return STACK_GUARD_PAGES * sysconf(_SC_PAGE_SIZE);
+}
+
+static unsigned long *stack_map(size_t size)
+{
+    // MAP_STACK ensures stack is on 16-byte boundary, returned address is the low end
+    // of the usable stack, with the PROT_NONE guard region just below it
+    size_t guard = guard_size();
+    char *base = mmap(NULL, guard + size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_STACK, -1, 0);
+    if (base == MAP_FAILED)
+    {
+        perror("Error allocating memory for stack");
+        exit(EXIT_FAILURE);
+    }
+    if ((uintptr_t)base % 16 != 0)
+    {
+        perror("Stack not properly aligned");
+        exit(EXIT_FAILURE);
+    }
+    if (mprotect(base, guard, PROT_NONE) == -1)
+    {
+        perror("Error protecting stack guard");
+        exit(EXIT_FAILURE);
+    }
+    return (unsigned long *)(base + guard);
+}
+
+static void stack_unmap(unsigned long *stack, size_t size)
+{
+    size_t guard = guard_size();
+    munmap((char *)stack - guard, guard + size);
+}
+
+static size_t page_round(size_t size, size_t page)
+{
+    return (size + page - 1) / page * page;
+}
+
+static int thp_enabled(void)
+{
+    // madvise(MADV_HUGEPAGE) succeeds even when THP is switched off, so ask sysfs
+    char line[128];
+    FILE *f = fopen("/sys/kernel/mm/transparent_hugepage/enabled", "r");
+    int on = 0;
+
+    if (f != NULL)
+    {
+        on = fgets(line, sizeof(line), f) != NULL && strstr(line, "[never]") == NULL;
+        fclose(f);
+    }
+    return on;
+}
+
+static void arena_free_init(void)
+{
+    // room to list every slot the arena can hold as free
+    free(arena.free);
+    arena.free = malloc(arena.size / arena.slot * sizeof(unsigned long *));
+    if (arena.free == NULL)
+    {
+        perror("Error allocating stack arena");
+        exit(EXIT_FAILURE);
+    }
+    arena.nfree = 0;
+}
+
+int lwp_arena_init(size_t nstacks, size_t stacksize)
+{
+    /* map the stack arena, trying MAP_HUGETLB first, then transparent huge
+    pages, then plain pages. Returns the LWP_ARENA_* mode that stuck. Only the
+    plain page fallback gets guard gaps, a 4K PROT_NONE page inside a huge page
+    would just split it back into small pages. So huge page stacks are
+    unguarded: an overflow lands in the next slot, with no diagnostic. */
+    long page_size = sysconf(_SC_PAGE_SIZE);
+    char *base;
+
+    if (arena.base != NULL)
+    {
+        return arena.mode;
+    }
+    arena.stacksize = page_round(stacksize, page_size);
+
+    // 1. real huge pages, only works if the admin reserved some (vm.nr_hugepages)
+    arena.guard = 0;
+    arena.slot = arena.stacksize;
+    arena.size = page_round(nstacks * arena.slot, HUGE_PAGE_SIZE);
+    base = mmap(NULL, arena.size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_STACK | MAP_HUGETLB, -1, 0);
+    if (base != MAP_FAILED)
+    {
+        arena.base = base;
+        arena.mode = LWP_ARENA_HUGETLB;
+        arena_free_init();
+        return arena.mode;
+    }
+
+    // 2. and 3. need a 2MB aligned start, so over-map and trim
+    base = mmap(NULL, arena.size + HUGE_PAGE_SIZE, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_STACK, -1, 0);
+    if (base == MAP_FAILED)
+    {
+        perror("Error allocating stack arena");
+        exit(EXIT_FAILURE);
+    }
+    char *aligned = (char *)page_round((uintptr_t)base, HUGE_PAGE_SIZE);
+    if (aligned != base)
+    {
+        munmap(base, aligned - base);
+    }
+    munmap(aligned + arena.size, HUGE_PAGE_SIZE - (aligned - base));
+    arena.base = aligned;
+    arena_free_init();
+
+    if (thp_enabled() && madvise(arena.base, arena.size, MADV_HUGEPAGE) == 0)
+    {
+        arena.mode = LWP_ARENA_THP;
+        return arena.mode;
+    }
+
+    // small pages after all, so a guard gap per stack costs no TLB reach
+    arena.guard = page_size;
+    arena.slot = arena.stacksize + arena.guard;
+    if (nstacks * arena.slot > arena.size)
+    {
+        munmap(arena.base, arena.size);
+        arena.size = nstacks * arena.slot;
+        arena.base = mmap(NULL, arena.size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_STACK, -1, 0);
+        if (arena.base == MAP_FAILED)
+        {
+            perror("Error allocating stack arena");
+            exit(EXIT_FAILURE);
+        }
+        arena_free_init();
+    }
+    arena.mode = LWP_ARENA_PAGES;
+    return arena.mode;
+}
+
+static unsigned long *arena_take(size_t size)
+{
+    // a slot from the arena, or NULL if it is full or the stack would not fit
+    unsigned long *slot;
+
+    if (size > arena.stacksize)
+    {
+        return NULL;
+    }
+    if (arena.nfree > 0)
+    {
+        return arena.free[--arena.nfree];
+    }
+    if (arena.next + arena.slot > arena.size)
+    {
+        return NULL;
+    }
+    slot = (unsigned long *)(arena.base + arena.next + arena.guard);
+    if (arena.guard != 0)
+    {
+        // a failed mprotect only costs us the overflow check, the stack is still good
+        mprotect(arena.base + arena.next, arena.guard, PROT_NONE);
+    }
+    arena.next += arena.slot;
+    return slot;
+}
+
+int stack_in_arena(thread c)
+{
+    return arena.base != NULL && (char *)c->stack >= arena.base && (char *)c->stack < arena.base + arena.size;
+}
+
+size_t stack_guard(thread c)
+{
+    // bytes of PROT_NONE just below c->stack
+    if (c->stack == NULL)
+    {
+        return 0; // the original thread, the kernel looks after its stack
+    }
+    if (stack_in_arena(c))
+    {
+        return arena.guard;
+    }
+    return guard_size();
+}
+
+static void stack_overflow_handler(int sig, siginfo_t *info, void *ucontext)
+{
+    /* runs on the alternate signal stack, since the faulting stack is the one
+    that is out of room. If the fault is in the guard of the running lwp say
+    which one it was, then let the default action take the process down.
+    Formats by hand and only calls write(2), stdio isn't async-signal-safe */
+    thread t = tid2thread(current_running_thread_tid);
+    char *addr = info->si_addr;
+    char msg[256];
+    size_t len = 0;
+
+    if (t != NULL && stack_guard(t) != 0 && addr >= (char *)t->stack - stack_guard(t) && addr < (char *)t->stack)
+    {
+        put_str(msg, &len, sizeof(msg), "lwp: stack overflow in tid ");
+        put_num(msg, &len, sizeof(msg), t->tid, 10);
+        put_str(msg, &len, sizeof(msg), ": stack 0x");
+        put_num(msg, &len, sizeof(msg), (unsigned long)t->stack, 16);
+        put_str(msg, &len, sizeof(msg), "-0x");
+        put_num(msg, &len, sizeof(msg), (unsigned long)stack_top(t), 16);
+        put_str(msg, &len, sizeof(msg), " (");
+        put_num(msg, &len, sizeof(msg), t->stacksize, 10);
+        put_str(msg, &len, sizeof(msg), " bytes), fault at 0x");
+        put_num(msg, &len, sizeof(msg), (unsigned long)addr, 16);
+        put_str(msg, &len, sizeof(msg), "\n");
+        write(STDERR_FILENO, msg, len);
+        signal(SIGSEGV, SIG_DFL);
+        return;
+    }
+    // not ours, put back whatever was there before and fault again into it
+    sigaction(SIGSEGV, &previous_segv, NULL);
+}
+
+static void stack_guard_init(void)
+{
+    // install the SIGSEGV handler on its own stack, once
+    stack_t ss;
+    struct sigaction sa;
+
+    if (guard_installed)
+    {
+        return;
+    }
+    guard_installed = 1;
+
+    ss.ss_sp = guard_altstack;
+    ss.ss_size = sizeof(guard_altstack);
+    ss.ss_flags = 0;
+    if (sigaltstack(&ss, NULL) == -1)
+    {
+        perror("sigaltstack");
+        return;
+    }
+
+    sa.sa_sigaction = stack_overflow_handler;
+    sigemptyset(&sa.sa_mask);
+    sa.sa_flags = SA_SIGINFO | SA_ONSTACK;
+    if (sigaction(SIGSEGV, &sa, &previous_segv) == -1)
+    {
+        perror("sigaction");
+    }
+}
+
+static void stack_fill_canary(thread c)
+{
+    // in canary mode every word of a fresh stack starts out as STACK_CANARY.
+    // This touches the whole stack, so it is for measuring runs, not production
+    if (c->watermark == LWP_WATERMARK_CANARY)
+    {
+        unsigned long *word;
+        for (word = c->stack; word < stack_top(c); word++)
+        {
+            *word = STACK_CANARY;
+        }
+    }
+}
+
+static size_t stack_size(const lwp_attr *attr)
+{
+    // bytes of usable stack asked for by attr, rounded up to whole pages
+    if (attr != NULL && attr->stacksize != 0)
+    {
+        return page_round(attr->stacksize, sysconf(_SC_PAGE_SIZE));
+    }
+    return stack_default_size();
+}
+
+static void stack_prefault(unsigned long *top, size_t len)
+{
+    // fault in [top - len, top) now rather than on the first calls of the thread
+    char *start = (char *)top - len;
+    long page_size = sysconf(_SC_PAGE_SIZE);
+    char *page;
+
+    if (madvise(start, len, MADV_POPULATE_WRITE) == 0)
+    {
+        return;
+    }
+    // older kernel, write one byte per page by hand (keeping any canary intact)
+    for (page = (char *)top - page_size; page >= start; page -= page_size)
+    {
+        *(volatile char *)page = *(volatile char *)page;
+    }
+}
+
+static void stack_prepare(thread c, const lwp_attr *attr)
+{
+    // last touches on a fresh or recycled stack before the thread gets it.
+    // The mode is fixed now, a canary can't be written after the fact
+    c->watermark = watermark_mode;
+    stack_fill_canary(c);
+    if (attr != NULL && attr->prefault != 0)
+    {
+        long page_size = sysconf(_SC_PAGE_SIZE);
+        size_t len = page_round(attr->prefault, page_size);
+        stack_prefault(stack_top(c), len < c->stacksize ? len : c->stacksize);
+    }
+}
+
+static unsigned long *pool_take(size_t size)
+{
+    // a parked stack of exactly this size, or NULL
+    pooled_stack *p, **link;
+    unsigned long *stack;
+
+    for (link = &pool; (p = *link) != NULL; link = &p->next)
+    {
+        if (p->size == size)
+        {
+            *link = p->next;
+            pool_count--;
+            statpage_pool(pool_count);
+            stack = p->stack;
+            free(p);
+            return stack;
+        }
+    }
+    return NULL;
+}
+
+static int pool_put(unsigned long *stack, size_t size)
+{
+    // park a stack for reuse. Only the top pool_warm bytes stay resident, the
+    // rest is given back so the next owner starts out as on a fresh stack.
+    // Returns 0 if the pool is full
+    pooled_stack *p;
+
+    if (pool_count >= pool_limit || (p = malloc(sizeof(pooled_stack))) == NULL)
+    {
+        return 0;
+    }
+    if (size > pool_warm)
+    {
+        madvise(stack, size - pool_warm, MADV_DONTNEED);
+    }
+    p->stack = stack;
+    p->size = size;
+    p->next = pool;
+    pool = p;
+    pool_count++;
+    statpage_pool(pool_count);
+    return 1;
+}
+
+void lwp_stack_pool_fill(size_t count, const lwp_attr *attr)
+{
+    /* map, prefault and park count stacks shaped by attr so that later
+    lwp_create_attr() calls with the same stacksize never take a fault on
+    their first frames. There is no pool until this is called: it holds
+    count more stacks after each call, and stacks of reaped threads go back
+    in it while there is room */
+    long page_size = sysconf(_SC_PAGE_SIZE);
+    unsigned long *stack;
+    size_t size, i;
+
+    stack_guard_init();
+    pool_limit += count;
+    size = stack_size(attr);
+    pool_warm = attr != NULL ? page_round(attr->prefault, page_size) : 0;
+    if (pool_warm > size)
+    {
+        pool_warm = size;
+    }
+    for (i = 0; i < count; i++)
+    {
+        // no canary yet, stack_prepare() writes one when a thread takes it
+        stack = stack_map(size);
+        if (pool_warm != 0)
+        {
+            stack_prefault((unsigned long *)((char *)stack + size), pool_warm);
+        }
+        if (!pool_put(stack, size))
+        {
+            stack_unmap(stack, size);
+        }
+    }
+}
+
+size_t stack_pool_count(void)
+{
+    return pool_count;
+}
+
+void stack_alloc(thread c, const lwp_attr *attr)
+{
+    /* give c a stack: a dedicated mapping, a slot in the arena for
+    LWP_ATTR_ARENA threads, or a seat on one of the shared stacks for
+    LWP_ATTR_SHARED_STACK threads */
+    size_t size;
+
+    stack_guard_init();
+
+    if (attr != NULL && (attr->flags & LWP_ATTR_SHARED_STACK))
+    {
+        shared_stack *s = &shared_stacks[shared_next];
+        shared_next = (shared_next + 1) % LWP_SHARED_STACKS;
+        if (s->base == NULL)
+        {
+            s->size = stack_default_size();
+            s->base = stack_map(s->size);
+        }
+        c->shared = s;
+        c->stack = s->base;
+        c->stacksize = s->size;
+        c->watermark = watermark_mode;
+        return;
+    }
+
+    size = stack_size(attr);
+
+    if (attr != NULL && (attr->flags & LWP_ATTR_ARENA))
+    {
+        if (arena.base == NULL)
+        {
+            lwp_arena_init(ARENA_DEFAULT_STACKS, attr->stacksize != 0 ? size : ARENA_DEFAULT_STACKSIZE);
+        }
+        // a stack size of 0 means "whatever the arena was set up with" here
+        c->stack = arena_take(attr->stacksize != 0 ? size : arena.stacksize);
+        if (c->stack != NULL)
+        {
+            c->stacksize = arena.stacksize;
+            stack_prepare(c, attr);
+            return;
+        }
+        // arena is full or too small for this one, fall back to a mapping of its own
+    }
+    c->stack = pool_take(size);
+    if (c->stack == NULL)
+    {
+        c->stack = stack_map(size);
+    }
+    c->stacksize = size; // keep track of stack size in bytes
+    stack_prepare(c, attr);
+}
+
+void stack_free(thread c)
+{
+    if (c->shared != NULL)
+    {
+        // nothing to unmap, just make sure nobody thinks these frames are still live
+        if (c->shared->owner == c)
+        {
+            c->shared->owner = NULL;
+        }
+        free(c->save);
+        c->save = NULL;
+        c->savelen = c->savecap = 0;
+        return;
+    }
+    if (stack_in_arena(c))
+    {
+        arena.free[arena.nfree++] = c->stack;
+        return;
+    }
+    if (pool_put(c->stack, c->stacksize))
+    {
+        return;
+    }
+    stack_unmap(c->stack, c->stacksize);
+}
+
+unsigned long *stack_top(thread c)
+{
+    // high end of the stack, where the first frame goes
+    return c->stack + (c->stacksize / sizeof(unsigned long));
+}
+
+unsigned long *stack_stackless(size_t *size)
+{
+    /* the one stack every stackless context's steps run on, mapped the first time */
+    static unsigned long *stackless = NULL;
+    static size_t stackless_size = 0;
+
+    if (stackless == NULL)
+    {
+        stack_guard_init();
+        stackless_size = stack_default_size();
+        stackless = stack_map(stackless_size);
+    }
+    *size = stackless_size;
+    return stackless;
+}
+
+void stack_bounds_init(void)
+{
+    /* look up the original thread's stack. Not async-signal-safe, so
+    anything that wants stack_bounds() from a handler calls this first */
+    pthread_attr_t attr;
+    void *addr;
+    size_t size;
+
+    if (main_hi != 0 || pthread_getattr_np(pthread_self(), &attr) != 0)
+    {
+        return;
+    }
+    if (pthread_attr_getstack(&attr, &addr, &size) == 0)
+    {
+        main_lo = (unsigned long)addr;
+        main_hi = main_lo + size;
+    }
+    pthread_attr_destroy(&attr);
+}
+
+void stack_bounds(thread c, unsigned long *lo, unsigned long *hi)
+{
+    // the range c's frames live in while it runs, empty if nobody knows
+    if (c->stack == NULL)
+    {
+        *lo = main_lo;
+        *hi = main_hi;
+        return;
+    }
+    *lo = (unsigned long)c->stack;
+    *hi = (unsigned long)stack_top(c);
+}
+
+unsigned long *copystack_prime(thread c, size_t len)
+{
+    /* the shared stack may hold someone else's frames right now, so the first
+    frame of c is built in its save area. Returns the end of that area, which
+    stands in for the stack top until the first switch copies it in. */
+    c->save = malloc(len);
+    if (c->save == NULL)
+    {
+        perror("Error allocating copy-stack save area");
+        exit(EXIT_FAILURE);
+    }
+    c->savelen = c->savecap = len;
+    return (unsigned long *)((char *)c->save + len);
+}
+
+static void copystack_save(thread t)
+{
+    // copy the live part of t's stack (saved rsp up to the top) into a right-sized buffer
+    char *top = (char *)stack_top(t);
+    size_t len = top - (char *)t->state.rsp;
+
+    if (len > t->savecap || len < t->savecap / 2)
+    {
+        void *save = realloc(t->save, len);
+        if (save == NULL)
+        {
+            perror("Error growing copy-stack save area");
+            exit(EXIT_FAILURE);
+        }
+        t->save = save;
+        t->savecap = len;
+    }
+    memcpy(t->save, (void *)t->state.rsp, len);
+    t->savelen = len;
+    // copy-stack threads can't use a canary, the deepest switch-out is the best we see
+    if (len > t->stackpeak)
+    {
+        t->stackpeak = len;
+    }
+}
+
+static void copystack_load(thread t)
+{
+    // evict whoever is on t's shared stack and put t's frames back
+    shared_stack *s = t->shared;
+
+    if (s->owner == t)
+    {
+        return;
+    }
+    // a terminated owner will never run again, its frames can just be dropped
+    if (s->owner != NULL && !LWPTERMINATED(s->owner->status))
+    {
+        copystack_save(s->owner);
+    }
+    memcpy((char *)stack_top(t) - t->savelen, t->save, t->savelen);
+    s->owner = t;
+}
+
+static void copystack_trampoline(thread from, thread to)
+{
+    // running on trampoline_stack, so the shared stack is free to overwrite
+    copystack_load(to);
+    swap_rfiles(NULL, &to->state);
+}
+
+void copystack_switch(thread from, thread to)
+{
+    /* switch from -> to where to runs on a shared stack it does not currently own */
+    if (to->shared->owner != from)
+    {
+        copystack_load(to);
+        swap_rfiles(&from->state, &to->state);
+        return;
+    }
+
+    // same layout as the first frame of a new lwp, see lwp_create()
+    unsigned long *stack_pointer = trampoline_stack + TRAMPOLINE_WORDS;
+    stack_pointer--;
+    *stack_pointer = (unsigned long)0;
+    stack_pointer--;
+    *stack_pointer = (unsigned long)copystack_trampoline;
+    stack_pointer--;
+
+    if (!trampoline_ready)
+    {
+        trampoline_state.fxsave = FPU_INIT;
+        trampoline_ready = 1;
+    }
+    trampoline_state.rdi = (unsigned long)from;
+    trampoline_state.rsi = (unsigned long)to;
+    trampoline_state.rbp = (unsigned long)stack_pointer;
+    trampoline_state.rsp = (unsigned long)stack_pointer;
+    swap_rfiles(&from->state, &trampoline_state);
+}
+
+void lwp_stack_watermarks(int mode)
+{
+    /* pick how peak stack use is measured for threads created from now on */
+    watermark_mode = mode;
+}
+
+static size_t stack_measure(thread c)
+{
+    // bytes of c's stack that have been used, as far as its mode can tell
+    if (c->shared != NULL)
+    {
+        return c->stackpeak;
+    }
+    if (c->watermark == LWP_WATERMARK_CANARY)
+    {
+        // the first word from the bottom that isn't canary is the deepest write,
+        // above any lwp_scratch_alloc() bytes down there
+        unsigned long *word = (unsigned long *)((char *)c->stack + c->scratch_low);
+        while (word < stack_top(c) && *word == STACK_CANARY)
+        {
+            word++;
+        }
+        return (char *)stack_top(c) - (char *)word;
+    }
+    if (c->watermark == LWP_WATERMARK_MINCORE)
+    {
+        // the lowest resident page is as deep as the stack has gone. A recycled
+        // arena slot remembers earlier owners, so this can over-report there
+        long page_size = sysconf(_SC_PAGE_SIZE);
+        size_t pages = c->stacksize / page_size;
+        unsigned char *vec = malloc(pages);
+        size_t i, peak = 0;
+        if (vec == NULL || mincore(c->stack, c->stacksize, vec) == -1)
+        {
+            free(vec);
+            return 0;
+        }
+        for (i = c->scratch_low / page_size; i < pages; i++)
+        {
+            if (vec[i] & 1)
+            {
+                peak = c->stacksize - i * page_size;
+                break;
+            }
+        }
+        free(vec);
+        return peak;
+    }
+    return 0;
+}
+
+void stack_watermark(thread c)
+{
+    /* record the peak stack use of an exiting thread in its entry point's histogram */
+    lwp_stack_hist *h = NULL;
+    size_t i;
+    int b;
+
+    if (c->watermark == LWP_WATERMARK_OFF || c->stack == NULL)
+    {
+        return;
+    }
+    c->stackpeak = stack_measure(c);
+
+    for (i = 0; i < histogram_count; i++)
+    {
+        if (histograms[i].fun == c->fun)
+        {
+            h = &histograms[i];
+            break;
+        }
+    }
+    if (h == NULL)
+    {
+        lwp_stack_hist *grown = realloc(histograms, (histogram_count + 1) * sizeof(lwp_stack_hist));
+        if (grown == NULL)
+        {
+            perror("Error growing stack histograms");
+            return;
+        }
+        histograms = grown;
+        h = &histograms[histogram_count++];
+        memset(h, 0, sizeof(*h));
+        h->fun = c->fun;
+    }
+
+    // bucket b holds peaks below 1KB << b
+    for (b = 0; b < LWP_HIST_BUCKETS - 1 && c->stackpeak >= (1024UL << b); b++)
+        ;
+    h->bucket[b]++;
+    h->count++;
+    if (c->stackpeak > h->max)
+    {
+        h->max = c->stackpeak;
+    }
+}
+
+int lwp_stack_histogram(lwpfun fun, lwp_stack_hist *out)
+{
+    /* copy out the histogram for fun. Returns 0 if no thread running fun has
+    exited yet with watermarks on, 1 otherwise */
+    size_t i;
+    for (i = 0; i < histogram_count; i++)
+    {
+        if (histograms[i].fun == fun)
+        {
+            *out = histograms[i];
+            return 1;
+        }
+    }
+    return 0;
+}
@@ -0,0 +1,47 @@
+#ifndef STACKS_H
+#define STACKS_H
+
+#include "lwp.h"
+
+// number of execution stacks handed out to LWP_ATTR_SHARED_STACK threads
+#define LWP_SHARED_STACKS 4
+
+// PROT_NONE pages below every mapped stack, overflowing into them is reported
+#define STACK_GUARD_PAGES 1
+
+// huge pages are 2MB on x86_64
+#define HUGE_PAGE_SIZE (2UL * 1024 * 1024)
+
+// used when LWP_ATTR_ARENA is asked for before lwp_arena_init()
+#define ARENA_DEFAULT_STACKS 512
+#define ARENA_DEFAULT_STACKSIZE (64 * 1024)
+
+typedef struct shared_stack {
+    unsigned long *base;    // low end of the mapping
+    size_t size;            // bytes in the mapping
+    thread owner;           // thread whose frames are on the stack right now
+} shared_stack;
+
+size_t stack_default_size(void);
+void stack_alloc(thread c, const lwp_attr *attr);
+void stack_free(thread c);
+unsigned long *stack_top(thread c);
+int stack_in_arena(thread c);
+size_t stack_guard(thread c);
+void stack_watermark(thread c);
+size_t stack_pool_count(void);
+unsigned long *stack_stackless(size_t *size);
+void stack_bounds_init(void);
+void stack_bounds(thread c, unsigned long *lo, unsigned long *hi);
+
+// tid of the running lwp, kept by lwp.c
+extern tid_t current_running_thread_tid;
+
+// async-signal-safe formatting from stats.c, for the SIGSEGV handler
+void put_str(char *line, size_t *len, size_t cap, const char *str);
+void put_num(char *line, size_t *len, size_t cap, unsigned long long v, int base);
+
+unsigned long *copystack_prime(thread c, size_t len);
+void copystack_switch(thread from, thread to);
+
+#endif
@@ -0,0 +1,306 @@
+#include "lwp.h"
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+
+extern scheduler schedule;
+extern thread current;
+
+// from lwp.c
+void lwp_block(thread t, const char *on, void (*unpark)(thread, void *), void *where);
+void lwp_wake(thread t, thread waker);
+
+// threads parked on one side of a queue, linked through lib_one
+typedef struct park_list {
+    thread head;
+    thread tail;
+    int count;
+} park_list;
+
+struct lwp_stage {
+    char name[24];          // what lwp_dump() shows parked threads waiting in
+    lwpbatch fn;
+    void *arg;
+    lwp_stage *next;        // where lwp_stage_emit() goes
+    void **ring;            // capacity slots, depth of them in use from out
+    size_t capacity;
+    size_t in, out, depth;
+    int batch;
+    int closed;             // no more pushes, workers leave once it's empty
+    int workers;
+    int running;            // workers that haven't exited
+    tid_t *tids;
+    park_list producers;    // waiting for room
+    park_list consumers;    // waiting for items
+    lwp_stage_stat stat;
+};
+
+static void stage_unpark(thread t, void *where)
+{
+    /* take t off a park list, for lwp_cancel() */
+    park_list *l = where;
+    thread *link = &l->head;
+    thread prev = NULL;
+
+    while (*link != t)
+    {
+        prev = *link;
+        link = &(*link)->lib_one;
+    }
+    *link = t->lib_one;
+    if (l->tail == t)
+    {
+        l->tail = prev;
+    }
+    t->lib_one = NULL;
+    l->count--;
+}
+
+static int stage_park(park_list *l, const char *on)
+{
+    /* park the caller on l until stage_wake(). -1 without parking if nothing
+    else could run to wake it */
+    if (current == NULL || schedule->qlen() <= 1)
+    {
+        return -1;
+    }
+    current->lib_one = NULL;
+    if (l->tail == NULL)
+    {
+        l->head = current;
+    }
+    else
+    {
+        l->tail->lib_one = current;
+    }
+    l->tail = current;
+    l->count++;
+    lwp_block(current, on, stage_unpark, l);
+    return 0;
+}
+
+static void stage_wake(park_list *l, int n)
+{
+    /* readmit up to n of the threads parked on l, oldest first */
+    thread t;
+
+    while (n-- > 0 && (t = l->head) != NULL)
+    {
+        l->head = t->lib_one;
+        if (l->head == NULL)
+        {
+            l->tail = NULL;
+        }
+        t->lib_one = NULL;
+        l->count--;
+        lwp_wake(t, current);
+    }
+}
+
+static void stage_worker_done(void *arg)
+{
+    /* a worker is leaving, the last one out closes the next stage */
+    lwp_stage *s = arg;
+    if (--s->running == 0 && s->next != NULL)
+    {
+        lwp_stage_close(s->next);
+    }
+}
+
+static int stage_worker(void *place)
+{
+    /* take whatever is queued, up to a batch, and hand it to the stage's
+    function in one call. Leaves once the stage is closed and drained, and the
+    last one out closes the next stage */
+    lwp_stage *s = *(lwp_stage **)place;
+    void *items[s->batch];
+    lwp_cleanup cleanup;
+    int n;
+
+    lwp_cleanup_push(&cleanup, stage_worker_done, s); // also when cancelled
+    for (;;)
+    {
+        while (s->depth == 0)
+        {
+            if (s->closed || stage_park(&s->consumers, s->name) < 0)
+            {
+                goto done; // nothing more can come
+            }
+            s->stat.empty_parks++;
+        }
+        for (n = 0; n < s->batch && s->depth > 0; n++)
+        {
+            items[n] = s->ring[s->out];
+            s->out = s->out + 1 == s->capacity ? 0 : s->out + 1;
+            s->depth--;
+        }
+        // room for n more, the producers that fit go back on the run queue
+        stage_wake(&s->producers, n);
+        s->stat.items += n;
+        s->stat.batches++;
+        s->fn(s, items, n, s->arg);
+    }
+done:
+    lwp_cleanup_pop(1);
+    return 0;
+}
+
+lwp_stage *lwp_stage_create_attr(const char *name, int workers, size_t capacity, int batch, lwpbatch fn, void *arg,
+                                 const lwp_attr *attr)
+{
+    /* a stage of workers threads, created with attr (NULL for defaults),
+    calling fn(s, items, n, arg) on up to batch items at a time from a queue
+    of capacity. NULL if out of memory or the sizes aren't positive */
+    lwp_stage *s;
+    void *place;
+    int i;
+
+    if (workers <= 0 || capacity == 0 || batch <= 0 || fn == NULL)
+    {
+        return NULL;
+    }
+    s = calloc(1, sizeof(lwp_stage));
+    if (s == NULL)
+    {
+        perror("Error allocating stage");
+        return NULL;
+    }
+    s->ring = malloc(capacity * sizeof(void *));
+    s->tids = calloc(workers, sizeof(tid_t));
+    if (s->ring == NULL || s->tids == NULL)
+    {
+        perror("Error allocating stage queue");
+        free(s->ring);
+        free(s->tids);
+        free(s);
+        return NULL;
+    }
+    snprintf(s->name, sizeof(s->name), "%s", name != NULL ? name : "stage");
+    s->fn = fn;
+    s->arg = arg;
+    s->capacity = capacity;
+    s->batch = batch;
+    s->stat.capacity = capacity;
+    for (i = 0; i < workers; i++)
+    {
+        // joinable, so lwp_stage_wait() reaps them and lwp_wait() never sees them
+        s->tids[i] = lwp_create_inplace(stage_worker, NULL, sizeof(lwp_stage *), &place, attr);
+        if (s->tids[i] == NO_THREAD)
+        {
+            break;
+        }
+        *(lwp_stage **)place = s;
+        s->workers++;
+        s->running++;
+    }
+    return s;
+}
+
+lwp_stage *lwp_stage_create(const char *name, int workers, size_t capacity, int batch, lwpbatch fn, void *arg)
+{
+    return lwp_stage_create_attr(name, workers, capacity, batch, fn, arg, NULL);
+}
+
+void lwp_stage_connect(lwp_stage *from, lwp_stage *to)
+{
+    /* lwp_stage_emit() from from's function pushes into to, and to is closed once from's workers are gone */
+    from->next = to;
+}
+
+int lwp_stage_push(lwp_stage *s, void *item)
+{
+    /* queue item for s, parking while the queue is full. Returns 0, or -1 if
+    s is closed or the queue stays full with nothing else able to run */
+    while (s->depth == s->capacity)
+    {
+        if (s->closed || stage_park(&s->producers, s->name) < 0)
+        {
+            return -1;
+        }
+        s->stat.full_parks++;
+    }
+    if (s->closed)
+    {
+        return -1;
+    }
+    s->ring[s->in] = item;
+    s->in = s->in + 1 == s->capacity ? 0 : s->in + 1;
+    s->depth++;
+    if (s->depth > s->stat.depth_max)
+    {
+        s->stat.depth_max = s->depth;
+    }
+    // one worker per batch: it runs later and takes everything pushed by then
+    if (s->consumers.count > 0 && (s->depth == 1 || s->depth % s->batch == 0))
+    {
+        stage_wake(&s->consumers, 1);
+    }
+    return 0;
+}
+
+int lwp_stage_emit(lwp_stage *s, void *item)
+{
+    /* from s's function: push item into the stage s is connected to. -1 if
+    there is none, or if it is closed, when item is dropped and counted in
+    s's dropped */
+    if (s->next == NULL)
+    {
+        return -1;
+    }
+    if (lwp_stage_push(s->next, item) < 0)
+    {
+        s->stat.dropped++;
+        return -1;
+    }
+    return 0;
+}
+
+void lwp_stage_close(lwp_stage *s)
+{
+    /* no more input: the workers finish what is queued and exit. Producers
+    parked on a full queue get -1 */
+    s->closed = 1;
+    stage_wake(&s->consumers, s->consumers.count);
+    stage_wake(&s->producers, s->producers.count);
+}
+
+int lwp_stage_wait(lwp_stage *s)
+{
+    /* wait for the workers of s and every stage after it to exit, and reap
+    them. Close the first stage before waiting on it. Returns 0, or -1 if
+    some are parked with nothing left to run that could wake them; those
+    still use their stage, so it can't be destroyed yet */
+    int i, left = 0;
+
+    for (; s != NULL; s = s->next)
+    {
+        for (i = 0; i < s->workers; i++)
+        {
+            if (s->tids[i] == NO_THREAD)
+            {
+                continue;
+            }
+            if (lwp_join(s->tids[i], NULL) == NO_THREAD)
+            {
+                left++;
+                continue;
+            }
+            s->tids[i] = NO_THREAD;
+        }
+    }
+    return left > 0 ? -1 : 0;
+}
+
+void lwp_stage_stats(const lwp_stage *s, lwp_stage_stat *out)
+{
+    *out = s->stat;
+    out->depth = s->depth;
+}
+
+void lwp_stage_destroy(lwp_stage *s)
+{
+    /* free a stage whose workers lwp_stage_wait() has reaped */
+    free(s->ring);
+    free(s->tids);
+    free(s);
+}
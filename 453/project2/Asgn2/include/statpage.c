@@ -0,0 +1,129 @@
+#include "lwp.h"
+#include "stacks.h"
+#include "statpage.h"
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+
+extern scheduler schedule;
+extern thread all_threads;
+
+statpage *stat_page = NULL;
+static statpage_sched *last_slot = NULL;
+static char page_name[64];
+static int unlink_at_exit = 0;
+
+statpage_sched *statpage_slot(scheduler s)
+{
+    // the counters for s, claiming a free slot the first time. NULL once all are taken
+    int i;
+
+    if (last_slot != NULL && last_slot->id == (uint64_t)(unsigned long)s)
+    {
+        return last_slot;
+    }
+    for (i = 0; i < STATPAGE_SCHEDULERS; i++)
+    {
+        statpage_sched *slot = &stat_page->sched[i];
+        if (slot->id == 0)
+        {
+            // only the name and id, the counters are already zero
+            statpage_begin();
+            snprintf(slot->name, sizeof(slot->name), "%s", lwp_sched_name(s));
+            slot->id = (unsigned long)s;
+            statpage_end();
+        }
+        if (slot->id == (uint64_t)(unsigned long)s)
+        {
+            last_slot = slot;
+            return slot;
+        }
+    }
+    return NULL;
+}
+
+int lwp_statpage_publish(const char *name)
+{
+    /* start keeping the counters in shared memory object name, "/lwp.<pid>"
+    if NULL. It is removed again by lwp_statpage_unpublish() or at exit().
+    Returns 0, or -1 if it can't be created */
+    statpage *page;
+    thread t;
+    int fd;
+
+    lwp_statpage_unpublish();
+    if (name == NULL)
+    {
+        snprintf(page_name, sizeof(page_name), "/lwp.%d", (int)getpid());
+    }
+    else
+    {
+        snprintf(page_name, sizeof(page_name), "%s", name);
+    }
+    fd = shm_open(page_name, O_RDWR | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0)
+    {
+        perror(page_name);
+        return -1;
+    }
+    if (ftruncate(fd, sizeof(statpage)) < 0)
+    {
+        perror("ftruncate");
+        close(fd);
+        shm_unlink(page_name);
+        return -1;
+    }
+    page = mmap(NULL, sizeof(statpage), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (page == MAP_FAILED)
+    {
+        perror("mmap");
+        shm_unlink(page_name);
+        return -1;
+    }
+
+    // threads made before now still count
+    page->pid = getpid();
+    page->size = sizeof(statpage);
+    for (t = all_threads; t != NULL; t = t->all_next)
+    {
+        if (LWPTERMINATED(t->status))
+        {
+            page->terminated++;
+        }
+        else
+        {
+            page->live++;
+        }
+    }
+    page->runq = schedule != NULL ? schedule->qlen() : 0;
+    page->pool = stack_pool_count();
+    // readers go by the magic, so it goes in last
+    __asm__ __volatile__("" ::: "memory");
+    memcpy(page->magic, STATPAGE_MAGIC, sizeof(page->magic));
+    stat_page = page;
+    if (!unlink_at_exit)
+    {
+        // a name with no process behind it would outlive us in /dev/shm
+        unlink_at_exit = atexit(lwp_statpage_unpublish) == 0;
+    }
+    return 0;
+}
+
+void lwp_statpage_unpublish(void)
+{
+    /* stop updating the page and remove it */
+    statpage *page = stat_page;
+
+    if (page == NULL)
+    {
+        return;
+    }
+    stat_page = NULL;
+    last_slot = NULL;
+    munmap(page, sizeof(statpage));
+    shm_unlink(page_name);
+}
@@ -0,0 +1,145 @@
+#ifndef STATPAGE_H
+#define STATPAGE_H
+
+#include <stdint.h>
+
+/* Live counters in shared memory for monitors outside the process.
+ * lwp_statpage_publish() maps /dev/shm/lwp.<pid> (or a name of your
+ * choosing) and from then on the library keeps it current with plain
+ * stores, until lwp_statpage_unpublish() or the process exits normally.
+ * A process that dies on a signal leaves the object behind in /dev/shm.
+ * A reader maps it read-only and takes consistent snapshots with the
+ * seqlock: seq is odd while an update is in progress, so copy, and retry
+ * if seq was odd or moved. lwpstat is such a reader.  shm_open() is in
+ * librt on glibc before 2.34, so link both sides with -lrt.
+ *
+ * There is only ever one writer (the one carrier all lwps run on) and x86
+ * keeps stores in order, so a compiler barrier is all the writer needs.
+ */
+
+#define STATPAGE_MAGIC      "LWPSTAT1"
+#define STATPAGE_SCHEDULERS 4
+
+typedef struct statpage_sched {
+    char     name[24];          // lwp_sched_name(), "" for an unused slot
+    uint64_t id;                // the scheduler pointer, tells customs apart
+    uint64_t admits;            // threads handed to it
+    uint64_t picks;             // switches to a thread it chose
+} statpage_sched;
+
+typedef struct statpage {
+    char     magic[8];
+    uint32_t pid;
+    uint32_t size;              // sizeof(statpage), readers check it
+    volatile uint64_t seq;
+    uint64_t runq;              // ready threads, as of the last switch
+    uint64_t live;              // created and not yet exited
+    uint64_t terminated;        // exited, waiting to be reaped
+    uint64_t created;
+    uint64_t reaped;
+    uint64_t switches;
+    uint64_t pool;              // stacks parked in the reuse pool
+    statpage_sched sched[STATPAGE_SCHEDULERS];
+} statpage;
+
+#ifdef LWPH
+extern statpage *stat_page;
+statpage_sched *statpage_slot(scheduler s);
+
+#define STATPAGE_BARRIER() __asm__ __volatile__("" ::: "memory")
+
+static inline void statpage_begin(void)
+{
+    stat_page->seq++;
+    STATPAGE_BARRIER();
+}
+
+static inline void statpage_end(void)
+{
+    STATPAGE_BARRIER();
+    stat_page->seq++;
+}
+
+static inline void statpage_admit(scheduler s)
+{
+    statpage_sched *slot;
+    if (stat_page == NULL)
+    {
+        return;
+    }
+    slot = statpage_slot(s);
+    statpage_begin();
+    if (slot != NULL)
+    {
+        slot->admits++;
+    }
+    statpage_end();
+}
+
+static inline void statpage_switch(scheduler s)
+{
+    statpage_sched *slot;
+    if (stat_page == NULL)
+    {
+        return;
+    }
+    slot = statpage_slot(s);
+    statpage_begin();
+    stat_page->switches++;
+    stat_page->runq = s->qlen();
+    if (slot != NULL)
+    {
+        slot->picks++;
+    }
+    statpage_end();
+}
+
+static inline void statpage_create(void)
+{
+    if (stat_page == NULL)
+    {
+        return;
+    }
+    statpage_begin();
+    stat_page->created++;
+    stat_page->live++;
+    statpage_end();
+}
+
+static inline void statpage_exit(void)
+{
+    if (stat_page == NULL)
+    {
+        return;
+    }
+    statpage_begin();
+    stat_page->live--;
+    stat_page->terminated++;
+    statpage_end();
+}
+
+static inline void statpage_reap(void)
+{
+    if (stat_page == NULL)
+    {
+        return;
+    }
+    statpage_begin();
+    stat_page->terminated--;
+    stat_page->reaped++;
+    statpage_end();
+}
+
+static inline void statpage_pool(size_t pool)
+{
+    if (stat_page == NULL)
+    {
+        return;
+    }
+    statpage_begin();
+    stat_page->pool = pool;
+    statpage_end();
+}
+#endif
+
+#endif
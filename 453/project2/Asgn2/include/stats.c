@@ -0,0 +1,252 @@
+#include "stats.h"
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <signal.h>
+#include <time.h>
+
+#ifdef LWP_STATS
+// the tsc rate comes from how far it and CLOCK_MONOTONIC_RAW have moved since
+// lwp_start(), so nothing spins for it and no thread's latency pays for it
+#define CALIBRATE_MIN_NS  1e6   // any shorter and the rate is too rough
+#define CALIBRATE_DONE_NS 1e9   // any longer buys nothing, stop asking the clock
+static double ns_per_tick = 0;
+static double base_ns = 0;
+static unsigned long long base_tsc = 0;
+static int calibrated = 0;
+
+static sched_hist sched_hists[STATS_MAX_SCHEDULERS];
+sched_hist *sched_hist_current = NULL;
+
+static double now_raw_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC_RAW, &ts);
+    return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+void stats_start(void)
+{
+    /* start the calibration interval, from lwp_start() */
+    if (base_tsc == 0)
+    {
+        base_ns = now_raw_ns();
+        base_tsc = __rdtsc();
+    }
+}
+
+static void stats_calibrate(void)
+{
+    // ns per tick over the interval so far. Only waits if asked within its first ms
+    double ns;
+
+    if (calibrated)
+    {
+        return;
+    }
+    stats_start(); // asked before lwp_start()
+    while ((ns = now_raw_ns() - base_ns) < CALIBRATE_MIN_NS)
+        ;
+    ns_per_tick = ns / (double)(__rdtsc() - base_tsc);
+    calibrated = ns >= CALIBRATE_DONE_NS;
+}
+#endif
+
+int lwp_stats(tid_t tid, lwp_stat *out)
+{
+    /* fill in out for tid. Returns 1 on success, 0 if there is no such
+    thread or the library was built without LWP_STATS */
+#ifdef LWP_STATS
+    thread t = tid2thread(tid);
+    unsigned long long oncpu;
+
+    if (t == NULL)
+    {
+        return 0;
+    }
+    stats_calibrate();
+    // the running thread's current slice isn't in oncpu yet
+    oncpu = t->oncpu;
+    if (tid == lwp_gettid() && !LWPTERMINATED(t->status))
+    {
+        oncpu += __rdtsc() - t->stamp;
+    }
+    out->oncpu_ns = oncpu * ns_per_tick;
+    out->ready_ns = t->readywait * ns_per_tick;
+    out->switches = t->switches;
+    return 1;
+#else
+    return 0;
+#endif
+}
+
+#ifdef LWP_STATS
+sched_hist *sched_hist_lookup(scheduler s)
+{
+    // the histograms for s, claiming a free slot the first time. NULL once all are taken
+    int i;
+    for (i = 0; i < STATS_MAX_SCHEDULERS; i++)
+    {
+        if (sched_hists[i].sched == s)
+        {
+            return &sched_hists[i];
+        }
+        if (sched_hists[i].sched == NULL)
+        {
+            sched_hists[i].sched = s;
+            return &sched_hists[i];
+        }
+    }
+    return NULL;
+}
+
+static unsigned long long hist_value(int index)
+{
+    // the largest value that lands in bucket index
+    int top;
+    if (index < HIST_SUB)
+    {
+        return index;
+    }
+    top = index / HIST_SUB + HIST_SUB_BITS - 1;
+    return ((unsigned long long)(HIST_SUB + index % HIST_SUB + 1) << (top - HIST_SUB_BITS)) - 1;
+}
+
+static unsigned long long hist_percentile(latency_hist *h, double p)
+{
+    // ticks at or below which p percent of the values fall
+    unsigned long long want = (unsigned long long)(h->count * p / 100.0), seen = 0;
+    int i;
+    for (i = 0; i < HIST_BUCKETS; i++)
+    {
+        seen += h->bucket[i];
+        if (seen > want)
+        {
+            return hist_value(i) < h->max ? hist_value(i) : h->max;
+        }
+    }
+    return h->max;
+}
+
+static void latency_fill(latency_hist *h, lwp_latency *out)
+{
+    out->count = h->count;
+    out->p50_ns = hist_percentile(h, 50) * ns_per_tick;
+    out->p90_ns = hist_percentile(h, 90) * ns_per_tick;
+    out->p99_ns = hist_percentile(h, 99) * ns_per_tick;
+    out->p999_ns = hist_percentile(h, 99.9) * ns_per_tick;
+    out->max_ns = h->max * ns_per_tick;
+}
+#endif
+
+int lwp_sched_latency(scheduler s, lwp_latency *ready, lwp_latency *slice)
+{
+    /* ready-to-running latency and slice length percentiles for s. Returns 1,
+    or 0 if s has never been in charge or the library was built without LWP_STATS */
+#ifdef LWP_STATS
+    int i;
+    for (i = 0; i < STATS_MAX_SCHEDULERS; i++)
+    {
+        if (sched_hists[i].sched == s)
+        {
+            stats_calibrate();
+            latency_fill(&sched_hists[i].ready, ready);
+            latency_fill(&sched_hists[i].slice, slice);
+            return 1;
+        }
+    }
+#endif
+    return 0;
+}
+
+// always built, the SIGSEGV handler in stacks.c formats with them too
+void put_str(char *line, size_t *len, size_t cap, const char *str)
+{
+    // append str to line, dropping whatever doesn't fit
+    while (*str != '\0' && *len < cap)
+    {
+        line[(*len)++] = *str++;
+    }
+}
+
+void put_num(char *line, size_t *len, size_t cap, unsigned long long v, int base)
+{
+    // append v in base 10 or 16, without going near stdio
+    char digits[24];
+    int n = 0;
+
+    do
+    {
+        digits[n++] = "0123456789abcdef"[v % base];
+        v /= base;
+    } while (v != 0);
+    while (n > 0 && *len < cap)
+    {
+        line[(*len)++] = digits[--n];
+    }
+}
+
+void lwp_latency_dump(int fd)
+{
+    /* one line per scheduler and histogram to fd. Formats by hand and only
+    calls write(2), so it is async-signal-safe and the SIGUSR1 handler can
+    call it */
+#ifdef LWP_STATS
+    static const char *pct[5] = {" p50=", "ns p90=", "ns p99=", "ns p999=", "ns max="};
+    lwp_latency l[2];
+    const char *what[2] = {"ready", "slice"};
+    unsigned long long v[5];
+    char line[256];
+    size_t len;
+    int i, j, k;
+
+    for (i = 0; i < STATS_MAX_SCHEDULERS && sched_hists[i].sched != NULL; i++)
+    {
+        scheduler s = sched_hists[i].sched;
+        lwp_sched_latency(s, &l[0], &l[1]);
+        for (j = 0; j < 2; j++)
+        {
+            // "name 0xaddr what: n=N p50=Nns p90=Nns p99=Nns p999=Nns max=Nns"
+            v[0] = l[j].p50_ns;
+            v[1] = l[j].p90_ns;
+            v[2] = l[j].p99_ns;
+            v[3] = l[j].p999_ns;
+            v[4] = l[j].max_ns;
+            len = 0;
+            put_str(line, &len, sizeof(line), lwp_sched_name(s));
+            put_str(line, &len, sizeof(line), " 0x");
+            put_num(line, &len, sizeof(line), (unsigned long)s, 16);
+            put_str(line, &len, sizeof(line), " ");
+            put_str(line, &len, sizeof(line), what[j]);
+            put_str(line, &len, sizeof(line), ": n=");
+            put_num(line, &len, sizeof(line), l[j].count, 10);
+            for (k = 0; k < 5; k++)
+            {
+                put_str(line, &len, sizeof(line), pct[k]);
+                put_num(line, &len, sizeof(line), v[k], 10);
+            }
+            put_str(line, &len, sizeof(line), "ns\n");
+            write(fd, line, len);
+        }
+    }
+#endif
+}
+
+static void latency_sigusr1(int sig)
+{
+    lwp_latency_dump(STDERR_FILENO);
+}
+
+void lwp_latency_on_signal(int sig)
+{
+    /* dump the histograms to stderr whenever sig (normally SIGUSR1) arrives */
+    struct sigaction sa;
+
+    sa.sa_handler = latency_sigusr1;
+    sigemptyset(&sa.sa_mask);
+    sa.sa_flags = SA_RESTART;
+    if (sigaction(sig, &sa, NULL) < 0)
+    {
+        perror("sigaction");
+    }
+}
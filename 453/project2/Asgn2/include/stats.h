@@ -0,0 +1,95 @@
+#ifndef STATS_H
+#define STATS_H
+
+#include "lwp.h"
+
+/* Accounting hooks for the switch paths in lwp.c. Build the library with
+ * -DLWP_STATS to get them, without it they compile to nothing. */
+
+#ifdef LWP_STATS
+#include <x86intrin.h>
+
+/* Log-linear latency histogram, HDR style: values below 8 ticks get a bucket
+ * each, above that every power of two is split into 8 linear sub-buckets, so
+ * any value is known to within 12.5% */
+#define HIST_SUB_BITS 3
+#define HIST_SUB      (1 << HIST_SUB_BITS)
+#define HIST_BUCKETS  ((64 - HIST_SUB_BITS + 1) * HIST_SUB)
+
+typedef struct latency_hist {
+    unsigned long long count;
+    unsigned long long max;
+    unsigned long long bucket[HIST_BUCKETS];
+} latency_hist;
+
+// one pair of histograms per scheduler that has been in charge
+#define STATS_MAX_SCHEDULERS 8
+typedef struct sched_hist {
+    scheduler sched;
+    latency_hist ready;     // admit (or switch-out while still ready) to switch-in
+    latency_hist slice;     // switch-in to switch-out
+} sched_hist;
+
+extern scheduler schedule;  // from lwp.c
+extern sched_hist *sched_hist_current;
+sched_hist *sched_hist_lookup(scheduler s);
+void stats_start(void);
+
+static inline void hist_add(latency_hist *h, unsigned long long v)
+{
+    int index;
+    if (v < HIST_SUB)
+    {
+        index = v;
+    }
+    else
+    {
+        int top = 63 - __builtin_clzll(v); // top >= HIST_SUB_BITS
+        index = (top - HIST_SUB_BITS + 1) * HIST_SUB + ((v >> (top - HIST_SUB_BITS)) & (HIST_SUB - 1));
+    }
+    h->bucket[index]++;
+    h->count++;
+    if (v > h->max)
+    {
+        h->max = v;
+    }
+}
+
+static inline void stats_admit(thread t)
+{
+    // ready from now on
+    t->stamp = __rdtsc();
+}
+
+static inline void stats_switch(thread from, thread to)
+{
+    // from stops running (and waits from here if it stays ready), to starts
+    unsigned long long now = __rdtsc();
+    sched_hist *h = sched_hist_current;
+
+    if (h == NULL || h->sched != schedule)
+    {
+        h = sched_hist_current = sched_hist_lookup(schedule);
+    }
+    if (h != NULL)
+    {
+        hist_add(&h->slice, now - from->stamp);
+        if (from != to)
+        {
+            // a lone thread yielding to itself never waited
+            hist_add(&h->ready, now - to->stamp);
+        }
+    }
+    from->oncpu += now - from->stamp;
+    from->stamp = now;
+    to->readywait += now - to->stamp; // nothing when to is from, stamped just above
+    to->stamp = now;
+    to->switches++;
+}
+#else
+#define stats_start()
+#define stats_admit(t)
+#define stats_switch(from, to)
+#endif
+
+#endif
@@ -1,5 +1,6 @@
 #include "thread_list.h"
 #include <stdio.h>
+#include <stdlib.h>
 #include <sys/mman.h>
 
 
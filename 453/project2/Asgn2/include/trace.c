@@ -0,0 +1,97 @@
+#include "lwp.h"
+#include "trace.h"
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+#ifdef LWP_TRACE
+trace_record *trace_ring = NULL;
+uint64_t trace_mask = 0;
+uint64_t trace_next = 0;
+uint64_t trace_base = 0;
+
+// tsc and clock at start, for converting ticks when dumping
+static double start_ns;
+
+static double now_raw_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC_RAW, &ts);
+    return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+#endif
+
+int lwp_trace_start(size_t records)
+{
+    /* start recording into a ring of at least records entries (rounded up to a
+    power of two). Returns 0, or -1 if the library was built without LWP_TRACE */
+#ifdef LWP_TRACE
+    size_t size = 1;
+    while (size < records)
+    {
+        size <<= 1;
+    }
+    free(trace_ring);
+    trace_ring = NULL;
+    trace_record *ring = calloc(size, sizeof(trace_record));
+    if (ring == NULL)
+    {
+        perror("Error allocating trace ring");
+        return -1;
+    }
+    trace_mask = size - 1;
+    trace_next = 0;
+    trace_base = __rdtsc();
+    start_ns = now_raw_ns();
+    trace_ring = ring;
+    return 0;
+#else
+    return -1;
+#endif
+}
+
+void lwp_trace_stop(void)
+{
+    /* stop recording and drop the ring */
+#ifdef LWP_TRACE
+    trace_record *ring = trace_ring;
+    trace_ring = NULL;
+    free(ring);
+#endif
+}
+
+long lwp_trace_dump(const char *path)
+{
+    /* write what the ring holds, oldest first, to path. Recording carries on.
+    Returns the number of records written or -1 */
+#ifdef LWP_TRACE
+    trace_header header;
+    uint64_t first, i;
+    FILE *out;
+
+    if (trace_ring == NULL)
+    {
+        return -1;
+    }
+    out = fopen(path, "wb");
+    if (out == NULL)
+    {
+        perror(path);
+        return -1;
+    }
+    first = trace_next > trace_mask + 1 ? trace_next - (trace_mask + 1) : 0;
+    memcpy(header.magic, TRACE_MAGIC, sizeof(header.magic));
+    header.count = trace_next - first;
+    header.ns_per_tick = (now_raw_ns() - start_ns) / (double)(__rdtsc() - trace_base);
+    fwrite(&header, sizeof(header), 1, out);
+    for (i = first; i < trace_next; i++)
+    {
+        fwrite(&trace_ring[i & trace_mask], sizeof(trace_record), 1, out);
+    }
+    fclose(out);
+    return header.count;
+#else
+    return -1;
+#endif
+}
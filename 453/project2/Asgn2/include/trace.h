@@ -0,0 +1,62 @@
+#ifndef TRACE_H
+#define TRACE_H
+
+#include <stdint.h>
+
+/* Scheduler event tracing. Build the library with -DLWP_TRACE to get the
+ * hooks, then lwp_trace_start() turns recording on. Records go into one
+ * ring per carrier (there is only the one carrier today), written with
+ * plain stores by the only thread that can touch it, so no locks and it is
+ * safe from signal handlers. Old records are overwritten when it wraps.
+ * lwptrace turns a dump into Chrome trace JSON. */
+
+enum trace_type {
+    TRACE_CREATE = 1,   // tid created, arg = creator
+    TRACE_ADMIT,        // tid handed to the scheduler
+    TRACE_SWITCH,       // tid switched out, arg = tid switched in
+    TRACE_BLOCK,        // tid parked itself
+    TRACE_WAKE,         // tid woken, arg = waker
+    TRACE_EXIT          // tid exited, arg = status
+};
+
+// 16 bytes a record: ticks since lwp_trace_start() in the top 56 bits, type in the low 8
+typedef struct trace_record {
+    uint64_t when;
+    uint32_t tid;
+    uint32_t arg;
+} trace_record;
+
+// dump file: this header, then count records oldest first
+#define TRACE_MAGIC "LWPTRACE"
+typedef struct trace_header {
+    char     magic[8];
+    uint64_t count;
+    double   ns_per_tick;
+} trace_header;
+
+#ifdef LWP_TRACE
+#include <x86intrin.h>
+
+extern trace_record *trace_ring;
+extern uint64_t trace_mask;
+extern uint64_t trace_next;
+extern uint64_t trace_base;
+
+static inline void trace_event(int type, unsigned long tid, unsigned long arg)
+{
+    trace_record *r;
+    if (trace_ring == NULL)
+    {
+        return;
+    }
+    r = &trace_ring[trace_next++ & trace_mask];
+    r->when = ((__rdtsc() - trace_base) << 8) | type;
+    r->tid = tid;
+    r->arg = arg;
+}
+#define TRACE(type, tid, arg) trace_event(type, tid, arg)
+#else
+#define TRACE(type, tid, arg)
+#endif
+
+#endif